@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "command-processor.h"
+#include "fs-context.h"
+
+// Runs many command files in one process on a pool of threads, each file with its own FsContext. A file's output is
+// captured in memory while it runs and written out once every earlier file has been written, so stdout and stderr
+// hold the same bytes as running ./fs on each file in turn. Files run concurrently must not use the same disk, unless
+// it is mounted once for all of them with -d: each file then runs in a context that shares that disk, so reads from
+// many files proceed in parallel, and the files cannot mount disks of their own.
+
+#define OUTPUT_WINDOW 8 // Files a worker may run ahead of the output, per thread, bounding the captured output held
+
+typedef struct {
+    const char *filename;
+    char *out; // Captured stdout and stderr of the file, set once it has run
+    char *err;
+    size_t out_size;
+    size_t err_size;
+    bool done;
+    bool failed; // Its output could not be captured
+} BatchJob;
+
+typedef struct {
+    BatchJob *jobs;
+    int num_jobs;
+    int next_job; // First file not yet taken by a worker
+    int written; // Files whose output has been written
+    int window;
+    FsContext *shared; // Context holding the disk given with -d, or NULL
+    pthread_mutex_t lock;
+    pthread_cond_t job_done; // Signalled when a file has run, for the writer
+    pthread_cond_t output_written; // Signalled when a file's output has been written, for workers held by the window
+} Batch;
+
+// Runs one command file in a fresh context, capturing its output
+static void run_job(FsContext *ctx, FsContext *shared, BatchJob *job) {
+    FILE *out = open_memstream(&job->out, &job->out_size);
+    FILE *err = open_memstream(&job->err, &job->err_size);
+    if (!out || !err) {
+        job->failed = true;
+        if (out) {
+            fclose(out);
+        }
+        if (err) {
+            fclose(err);
+        }
+        return;
+    }
+    if (shared) {
+        init_shared_context(ctx, shared, out, err);
+    } else {
+        init_context(ctx, out, err);
+    }
+    process_command_file(ctx, job->filename);
+    free_context(ctx);
+    fclose(out); // Sets job->out and job->out_size
+    fclose(err);
+}
+
+static void *worker(void *arg) {
+    Batch *batch = arg;
+    FsContext *ctx = malloc(sizeof(FsContext));
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        while (batch->next_job < batch->num_jobs && batch->next_job >= batch->written + batch->window) {
+            pthread_cond_wait(&batch->output_written, &batch->lock);
+        }
+        if (batch->next_job == batch->num_jobs) {
+            break;
+        }
+        BatchJob *job = &batch->jobs[batch->next_job++];
+        pthread_mutex_unlock(&batch->lock);
+        if (ctx) {
+            run_job(ctx, batch->shared, job);
+        } else {
+            job->failed = true;
+        }
+        pthread_mutex_lock(&batch->lock);
+        job->done = true;
+        pthread_cond_signal(&batch->job_done);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    free(ctx);
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: fs-batch [-j threads] [-d disk name] <command file>...\n"
+                    "  Runs each command file as ./fs would, on up to that many threads (default: one per CPU).\n"
+                    "  With -d, the disk is mounted once and every command file runs against it.\n");
+}
+
+int main(int argc, char *argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *shared_disk = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "j:d:")) != -1) {
+        switch (option) {
+        case 'j': threads = atol(optarg); break;
+        case 'd': shared_disk = optarg; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind == argc || threads < 1) {
+        usage();
+        return 1;
+    }
+    // The same settings as ./fs; they are process-wide, so they are read before any thread starts
+    char *policy = getenv("FS_ALLOC_POLICY");
+    if (policy) {
+        set_alloc_policy(policy);
+    }
+    char *backend = getenv("FS_DISK_BACKEND");
+    if (backend) {
+        set_disk_backend(backend);
+    }
+    if (getenv("FS_PUNCH_HOLES")) {
+        punch_holes = true;
+    }
+    char *read_ahead = getenv("FS_READ_AHEAD");
+    if (read_ahead) {
+        set_read_ahead(read_ahead);
+    }
+    if (getenv("FS_FSCK_REPORT")) {
+        report_all_violations = true;
+    }
+    Batch batch = {.num_jobs = argc - optind};
+    batch.jobs = calloc(batch.num_jobs, sizeof(BatchJob));
+    if (threads > batch.num_jobs) {
+        threads = batch.num_jobs;
+    }
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    if (!batch.jobs || !workers) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < batch.num_jobs; i++) {
+        batch.jobs[i].filename = argv[optind + i];
+    }
+    static FsContext shared;
+    if (shared_disk) {
+        init_context(&shared, stdout, stderr);
+        fs_mount(&shared, shared_disk);
+        if (!shared.volume->is_mounted) {
+            return 1;
+        }
+        batch.shared = &shared;
+    }
+    batch.window = threads * OUTPUT_WINDOW;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.job_done, NULL);
+    pthread_cond_init(&batch.output_written, NULL);
+    int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, worker, &batch) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: Cannot start worker threads\n");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 0; i < batch.num_jobs; i++) {
+        BatchJob *job = &batch.jobs[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!job->done) {
+            pthread_cond_wait(&batch.job_done, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        if (job->failed) {
+            fprintf(stderr, "Error: Cannot capture the output of %s\n", job->filename);
+            status = 1;
+        } else {
+            fwrite(job->out, 1, job->out_size, stdout);
+            fflush(stdout);
+            fwrite(job->err, 1, job->err_size, stderr);
+        }
+        free(job->out);
+        free(job->err);
+        pthread_mutex_lock(&batch.lock);
+        batch.written++;
+        pthread_cond_broadcast(&batch.output_written);
+        pthread_mutex_unlock(&batch.lock);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    if (shared_disk) {
+        free_context(&shared); // Writes the shared disk back
+    }
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.job_done);
+    pthread_cond_destroy(&batch.output_written);
+    free(workers);
+    free(batch.jobs);
+    return status;
+}
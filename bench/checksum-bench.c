@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "fs-context.h"
+#include "prefill.h"
+
+// Measures what block checksums cost: CRC32C time per 1 KiB block with each implementation (next to a plain copy of
+// the block), then the rate of single-block W and R commands on the same prefilled disk formatted without and with a
+// checksum table, and the time V takes to check the whole disk
+
+#define BLOCK 1024
+#define BLOCKS 65536 // 64 MB of blocks, more than the CPU caches hold
+#define OPERATIONS 200000
+
+// Returns the current monotonic time in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint32_t next_random(uint64_t *state, uint32_t bound) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 2685821657736338717ULL) >> 32) % bound;
+}
+
+// Nanoseconds per block to checksum every block of data once (memcpy instead when impl is NULL)
+static double time_blocks(const uint8_t *data, uint8_t *copy, const char *impl) {
+    uint32_t sum = 0;
+    if (impl) {
+        set_checksum_impl(impl);
+    }
+    double start = now_ns();
+    for (int b = 0; b < BLOCKS; b++) {
+        if (impl) {
+            sum ^= crc32c(0, data + (size_t)b * BLOCK, BLOCK);
+        } else {
+            memcpy(copy, data + (size_t)b * BLOCK, BLOCK);
+            sum ^= copy[b % BLOCK];
+        }
+    }
+    double elapsed = (now_ns() - start) / BLOCKS;
+    if (sum == 0x12345678) {
+        printf(" "); // Keeps the loop from being optimized away
+    }
+    return elapsed;
+}
+
+// Runs OPERATIONS single-block writes, then as many reads, at random blocks of the files of a freshly prefilled disk;
+// sets the nanoseconds per write, per read and per block checked by V
+static void time_commands(const char *disk_name, uint32_t features, double *write_ns, double *read_ns, double *scrub_ns) {
+    if (format_disk(disk_name, 2, BLOCK, BLOCKS, 4096, features) != 0) {
+        fprintf(stderr, "Error: Cannot format %s\n", disk_name);
+        exit(1);
+    }
+    FILE *null_stream = fopen("/dev/null", "w");
+    static FsContext ctx;
+    init_context(&ctx, null_stream, null_stream);
+    fs_mount(&ctx, (char *)disk_name);
+    if (!ctx.volume->is_mounted) {
+        exit(1);
+    }
+    seed_random(1);
+    PrefillOptions prefill = {2000, 0, 32, 0, 0};
+    prefill_disk(&ctx, &prefill);
+    fs_sync(&ctx);
+    int file_count = 0;
+    int *files = malloc(ctx.volume->superblock.num_inodes * sizeof(int));
+    for (int i = first_child_of(&ctx, ctx.volume->superblock.root); i != -1; i = next_child(&ctx, i)) {
+        if (!(ctx.volume->superblock.inode[i].isdir_parent & INODE_DIR)) {
+            files[file_count++] = i;
+        }
+    }
+    fs_buff(&ctx, (const uint8_t *)"checksum", 8);
+    double *results[2] = {write_ns, read_ns};
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t state = 0x9E3779B97F4A7C15ULL; // The same blocks in both passes
+        double start = now_ns();
+        for (int op = 0; op < OPERATIONS; op++) {
+            const Inode *inode = &ctx.volume->superblock.inode[files[next_random(&state, file_count)]];
+            char name[5];
+            memcpy(name, inode->name, 5);
+            int block = next_random(&state, inode->isused_size & INODE_FIELD_MASK);
+            if (pass == 0) {
+                fs_write(&ctx, name, block);
+            } else {
+                fs_read(&ctx, name, block);
+            }
+        }
+        *results[pass] = (now_ns() - start) / OPERATIONS;
+    }
+    int checked = 0; // Blocks V reads and checks: those written above
+    for (int b = 0; features & FEATURE_CHECKSUMS && b < BLOCKS; b++) {
+        checked += ctx.volume->superblock.block_checksums[b] != 0;
+    }
+    double start = now_ns();
+    fs_scrub(&ctx);
+    *scrub_ns = checked ? (now_ns() - start) / checked : 0;
+    free(files);
+    free_context(&ctx);
+    fclose(null_stream);
+    unlink(disk_name);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: checksum-bench <disk name>\n");
+        return 1;
+    }
+    uint8_t *data = malloc((size_t)BLOCKS * BLOCK);
+    uint8_t *copy = malloc(BLOCK);
+    if (!data || !copy) {
+        return 1;
+    }
+    uint64_t state = 1;
+    for (size_t i = 0; i < (size_t)BLOCKS * BLOCK; i++) {
+        data[i] = next_random(&state, 256);
+    }
+    time_blocks(data, copy, NULL); // Fault the pages in
+    printf("per 1 KiB block: memcpy %6.1f ns", time_blocks(data, copy, NULL));
+    if (set_checksum_impl("hardware") == 0) {
+        printf("   crc32c hardware %6.1f ns", time_blocks(data, copy, "hardware"));
+    }
+    printf("   crc32c table %6.1f ns\n", time_blocks(data, copy, "table"));
+    set_checksum_impl(set_checksum_impl("hardware") == 0 ? "hardware" : "table");
+    free(copy);
+    free(data);
+    double plain_write, plain_read, plain_scrub, checked_write, checked_read, checked_scrub;
+    time_commands(argv[1], 0, &plain_write, &plain_read, &plain_scrub);
+    time_commands(argv[1], FEATURE_CHECKSUMS, &checked_write, &checked_read, &checked_scrub);
+    printf("W %6.0f ns, %6.0f ns with checksums (%+.1f%%)   R %6.0f ns, %6.0f ns with checksums (%+.1f%%)   "
+           "V %.1f ns per block (%s)\n",
+           plain_write, checked_write, 100 * (checked_write / plain_write - 1), plain_read, checked_read,
+           100 * (checked_read / plain_read - 1), checked_scrub, checksum_impl_name());
+    return 0;
+}
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs-context.h"
+#include "prefill.h"
+
+// Generates a benchmark workload: <prefix>.disk, a prefilled (and optionally fragmented) disk, and <prefix>.cmds, a
+// command file that mounts a copy of it, <prefix>.run, and runs a fixed-seed mix of commands. Every command is also applied to a scratch copy
+// of the disk as it is generated, so names, sizes and block numbers always refer to the state the command will see.
+// With -p the commands name files by absolute path instead of moving around with Y: the same workload, without the Y
+// lines (an L is preceded by a Y to the directory it lists, so even the output stays the same).
+
+typedef struct {
+    char command;
+    int weight;
+} MixEntry;
+
+static MixEntry mix[] = {{'C', 30}, {'D', 20}, {'R', 15}, {'W', 15}, {'B', 5}, {'L', 5}, {'O', 0}, {'Y', 10}};
+#define MIX_SIZE (int)(sizeof(mix) / sizeof(mix[0]))
+
+// Parses a mix such as "C:30,D:20,O:1"; commands that are not listed keep their default weight
+static int parse_mix(const char *text) {
+    while (*text) {
+        char command;
+        int weight;
+        int consumed;
+        if (sscanf(text, "%c:%d%n", &command, &weight, &consumed) != 2 || weight < 0) {
+            return -1;
+        }
+        int i = 0;
+        while (i < MIX_SIZE && mix[i].command != command) {
+            i++;
+        }
+        if (i == MIX_SIZE) {
+            return -1;
+        }
+        mix[i].weight = weight;
+        text += consumed;
+        if (*text == ',') {
+            text++;
+        }
+    }
+    return 0;
+}
+
+// Collects the children of the current directory that are files (want_dirs false) or directories (true)
+static int children_of_kind(const FsContext *ctx, bool want_dirs, int *out, int limit) {
+    int count = 0;
+    for (int i = first_child_of(ctx, ctx->current_inode_index); i != -1 && count < limit; i = next_child(ctx, i)) {
+        if (((ctx->volume->superblock.inode[i].isdir_parent & INODE_DIR) != 0) == want_dirs) {
+            out[count++] = i;
+        }
+    }
+    return count;
+}
+
+// Sets prefix to the absolute path of the current directory with a trailing '/' ("/" for the root)
+static void directory_prefix(const FsContext *ctx, char *prefix, size_t size) {
+    int chain[64]; // Directories from the current one up to (not including) the root
+    int depth = 0;
+    for (int dir = ctx->current_inode_index; dir != (int)ctx->volume->superblock.root && depth < 64;
+         dir = ctx->volume->superblock.inode[dir].isdir_parent & INODE_FIELD_MASK) {
+        chain[depth++] = dir;
+    }
+    size_t length = snprintf(prefix, size, "/");
+    while (depth > 0 && length < size) {
+        length += snprintf(prefix + length, size - length, "%.5s/", ctx->volume->superblock.inode[chain[--depth]].name);
+    }
+}
+
+// Writes an L command; with paths (prefix not NULL) the command file first moves to the current directory if an
+// earlier L left it elsewhere
+static void write_list(FILE *commands, const FsContext *ctx, const char *prefix, int *listed_dir) {
+    if (prefix && *listed_dir != ctx->current_inode_index) {
+        int length = strlen(prefix);
+        fprintf(commands, "Y %.*s\n", length > 1 ? length - 1 : length, prefix); // Without the trailing '/' but "/"
+        *listed_dir = ctx->current_inode_index;
+    }
+    fprintf(commands, "L\n");
+}
+
+// Copies a disk file
+static int copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int status = in == -1 || out == -1 ? -1 : 0;
+    char chunk[65536];
+    ssize_t n;
+    while (status == 0 && (n = read(in, chunk, sizeof(chunk))) > 0) {
+        if (write(out, chunk, n) != n) {
+            status = -1;
+        }
+    }
+    if (in != -1) {
+        close(in);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    return status;
+}
+
+// Picks a command according to the mix weights
+static char pick_command(int total_weight) {
+    int ticket = random_below(total_weight);
+    for (int i = 0; i < MIX_SIZE; i++) {
+        if (ticket < mix[i].weight) {
+            return mix[i].command;
+        }
+        ticket -= mix[i].weight;
+    }
+    return 'L';
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: gen-workload [-s seed] [-n commands] [-m mix] [-f fragmentation%%] [-d depth] [-z max file blocks]\n"
+                    "                    [-g version,block size,blocks,inodes] [-p] <output prefix>\n"
+                    "  mix: weights per command, e.g. C:30,D:20,R:15,W:15,B:5,L:5,O:0,Y:10\n"
+                    "  fragmentation: percentage of the prefilled files deleted before the workload starts\n"
+                    "  -p: name files by absolute path instead of changing directories with Y\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = 1;
+    int command_count = 10000;
+    int fragmentation = 0;
+    int depth = 1;
+    int max_file_blocks = 8;
+    int version = 2;
+    unsigned block_size = 1024, num_blocks = 4096, num_inodes = 1024;
+    bool paths = false;
+    int option;
+    while ((option = getopt(argc, argv, "s:n:m:f:d:z:g:p")) != -1) {
+        switch (option) {
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'n': command_count = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) == -1) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'f': fragmentation = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'z': max_file_blocks = atoi(optarg); break;
+        case 'p': paths = true; break;
+        case 'g':
+            if (sscanf(optarg, "%d,%u,%u,%u", &version, &block_size, &num_blocks, &num_inodes) != 4) {
+                usage();
+                return 1;
+            }
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || command_count < 0 || fragmentation < 0 || fragmentation > 100 || depth < 0 || max_file_blocks < 1) {
+        usage();
+        return 1;
+    }
+    seed_random(seed);
+    char disk_name[1000], run_name[1000], scratch_name[1000], commands_name[1000];
+    snprintf(disk_name, sizeof(disk_name), "%s.disk", argv[optind]);
+    snprintf(run_name, sizeof(run_name), "%s.run", argv[optind]);
+    snprintf(scratch_name, sizeof(scratch_name), "%s.scratch", argv[optind]);
+    snprintf(commands_name, sizeof(commands_name), "%s.cmds", argv[optind]);
+    if (format_disk(disk_name, version, block_size, num_blocks, num_inodes, 0) != 0) {
+        fprintf(stderr, "gen-workload: cannot format %s\n", disk_name);
+        return 1;
+    }
+    FILE *commands = fopen(commands_name, "w");
+    if (!commands) {
+        perror(commands_name);
+        return 1;
+    }
+    // The file system reports its own errors; they are expected (a create can fail on a full disk) and not useful here
+    FILE *null_stream = fopen("/dev/null", "w");
+    if (!null_stream) {
+        return 1;
+    }
+    static FsContext ctx;
+    init_context(&ctx, null_stream, null_stream);
+    // Prefill: a directory tree, then files in random directories up to 70% of the data blocks
+    fs_mount(&ctx, disk_name);
+    PrefillOptions prefill = {0, 70, max_file_blocks, fragmentation, depth};
+    if (prefill_disk(&ctx, &prefill) == -1) {
+        return 1;
+    }
+    free_context(&ctx);
+    // Generate the workload against a scratch copy so the prefilled disk stays untouched for the benchmark
+    if (copy_file(disk_name, scratch_name) == -1) {
+        return 1;
+    }
+    init_context(&ctx, null_stream, null_stream);
+    fs_mount(&ctx, scratch_name);
+    fprintf(commands, "M %s\n", run_name);
+    int total_weight = 0;
+    for (int i = 0; i < MIX_SIZE; i++) {
+        total_weight += mix[i].weight;
+    }
+    int *children = malloc((ctx.volume->superblock.num_inodes + 1) * sizeof(int));
+    char prefix[64 * 6 + 2] = ""; // Path of the current directory put before names with -p
+    int listed_dir = ctx.volume->superblock.root; // Directory the command file is in with -p (it only changes for L)
+    if (paths) {
+        directory_prefix(&ctx, prefix, sizeof(prefix));
+    }
+    for (int n = 0; n < command_count && total_weight > 0; n++) {
+        char command = pick_command(total_weight);
+        int file_children = 0;
+        if (command == 'D' || command == 'R' || command == 'W') {
+            file_children = children_of_kind(&ctx, false, children, ctx.volume->superblock.num_inodes);
+            if (file_children == 0) {
+                command = 'Y'; // Nothing to delete, read or write here, move on to another directory
+            }
+        }
+        char name[5] = {0};
+        if (command == 'C') {
+            make_name('f', name);
+            int size = 1 + random_below(max_file_blocks);
+            fprintf(commands, "C %s%.5s %d\n", prefix, name, size);
+            fs_create(&ctx, name, size);
+        } else if (command == 'D' || command == 'R' || command == 'W') {
+            int inode_index = children[random_below(file_children)];
+            memcpy(name, ctx.volume->superblock.inode[inode_index].name, 5);
+            int block = random_below(ctx.volume->superblock.inode[inode_index].isused_size & INODE_FIELD_MASK);
+            if (command == 'D') {
+                fprintf(commands, "D %s%.5s\n", prefix, name);
+                fs_delete(&ctx, name);
+            } else {
+                fprintf(commands, "%c %s%.5s %d\n", command, prefix, name, block);
+                if (command == 'R') {
+                    fs_read(&ctx, name, block);
+                } else {
+                    fs_write(&ctx, name, block);
+                }
+            }
+        } else if (command == 'B') {
+            char text[64];
+            int length = snprintf(text, sizeof(text), "block %d of the workload", n);
+            fprintf(commands, "B %s\n", text);
+            fs_buff(&ctx, (uint8_t *)text, length);
+        } else if (command == 'L') {
+            write_list(commands, &ctx, paths ? prefix : NULL, &listed_dir);
+        } else if (command == 'O') {
+            fprintf(commands, "O\n");
+            fs_defrag(&ctx);
+        } else if (command == 'Y') {
+            // Go down into a random subdirectory, or back up when there is none (or now and then anyway)
+            int dir_children = children_of_kind(&ctx, true, children, ctx.volume->superblock.num_inodes);
+            if (dir_children > 0 && (ctx.current_inode_index == (int)ctx.volume->superblock.root || random_below(3) != 0)) {
+                memcpy(name, ctx.volume->superblock.inode[children[random_below(dir_children)]].name, 5);
+                if (!paths) {
+                    fprintf(commands, "Y %.5s\n", name);
+                }
+                fs_cd(&ctx, name);
+            } else if (ctx.current_inode_index != (int)ctx.volume->superblock.root) {
+                char parent[5] = "..";
+                if (!paths) {
+                    fprintf(commands, "Y ..\n");
+                }
+                fs_cd(&ctx, parent);
+            } else {
+                write_list(commands, &ctx, paths ? prefix : NULL, &listed_dir);
+            }
+            if (paths) {
+                directory_prefix(&ctx, prefix, sizeof(prefix));
+            }
+        }
+    }
+    free_context(&ctx);
+    unlink(scratch_name);
+    free(children);
+    fclose(commands);
+    fclose(null_stream);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs-context.h"
+
+// Measures the inode table scans that run on the used and directory bitsets of the directory index: the search for a
+// free inode (find_free_inode from inode 0 on a table whose only free inode is the last one) and the sweep over the
+// files of the table that defragmentation and V make (file_inode_bits), on a full table and on one with one inode in
+// sixteen used. Each is compared with the loop that decodes isused_size and isdir_parent inode by inode, for the
+// 126-entry table of a version 1 disk and for larger version 2 tables, in nanoseconds per scan and per inode. The loops
+// of this file are built without optimization, like the rest of the tree, so they run as they would in ./fs.
+
+#define SCAN_INODES 4000000 // Inodes scanned per measurement, whatever the table size
+
+// Returns the current monotonic time in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The free inode search as it decoded every inode before the bitsets
+__attribute__((optimize("O0"))) static int decode_free_inode(const Superblock *sb) {
+    for (uint32_t i = 0; i < sb->num_inodes; i++) {
+        if (!(sb->inode[i].isused_size & INODE_USED)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The file sweep as it decoded every inode before the bitsets; returns the number of files
+__attribute__((optimize("O0"))) static int decode_files(const Superblock *sb) {
+    int files = 0;
+    for (uint32_t i = 0; i < sb->num_inodes; i++) {
+        if (sb->inode[i].isused_size & INODE_USED && !(sb->inode[i].isdir_parent & INODE_DIR)) {
+            files++;
+        }
+    }
+    return files;
+}
+
+// The file sweep of gather_files_by_location and report_corrupt_block; returns the number of files
+__attribute__((optimize("O0"))) static int bitset_files(const FsContext *ctx) {
+    int files = 0;
+    uint32_t words = (ctx->volume->superblock.num_inodes + 63) / 64;
+    for (uint32_t word = 0; word < words; word++) {
+        for (uint64_t bits = file_inode_bits(ctx, word); bits != 0; bits &= bits - 1) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            files += i >= 0;
+        }
+    }
+    return files;
+}
+
+// Fills the inode table of the mounted disk: every step-th inode is used (one in eight of them a directory), except
+// the last inode, then rebuilds the directory index
+static void fill_table(FsContext *ctx, int step) {
+    Superblock *sb = &ctx->volume->superblock;
+    memset(sb->inode, 0, sb->num_inodes * sizeof(Inode));
+    for (uint32_t i = 0; i + 1 < sb->num_inodes; i += step) {
+        Inode *inode = &sb->inode[i];
+        snprintf(inode->name, 5, "%x", i % 0x10000);
+        bool is_dir = i / step % 8 == 0;
+        inode->isused_size = INODE_USED | (is_dir ? 0 : 1);
+        inode->start_block = is_dir ? 0 : sb->data_start;
+        inode->isdir_parent = (is_dir ? INODE_DIR : 0) | sb->root;
+    }
+    build_dir_index(ctx);
+}
+
+// Times one table: the free inode search on a full table, and the file sweep on a full and a sparse table
+static void time_table(const char *label, const char *disk_name) {
+    FILE *null_stream = fopen("/dev/null", "w");
+    static FsContext ctx;
+    init_context(&ctx, null_stream, null_stream);
+    fs_mount(&ctx, (char *)disk_name);
+    if (!ctx.volume->is_mounted) {
+        fprintf(stderr, "%s: cannot mount the disk\n", label);
+        exit(1);
+    }
+    uint32_t num_inodes = ctx.volume->superblock.num_inodes;
+    int rounds = SCAN_INODES / num_inodes;
+    int sink = 0;
+    double times[6]; // Free inode decoded and bitset, full sweep decoded and bitset, sparse sweep decoded and bitset
+    fill_table(&ctx, 1);
+    double start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        sink += decode_free_inode(&ctx.volume->superblock);
+    }
+    times[0] = (now_ns() - start) / rounds;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        ctx.volume->index.free_inode_hint = 0; // As after a delete of inode 0 and a create that reused it
+        sink += find_free_inode(&ctx);
+    }
+    times[1] = (now_ns() - start) / rounds;
+    for (int sparse = 0; sparse < 2; sparse++) {
+        fill_table(&ctx, sparse ? 16 : 1);
+        start = now_ns();
+        for (int r = 0; r < rounds; r++) {
+            sink += decode_files(&ctx.volume->superblock);
+        }
+        times[2 + 2 * sparse] = (now_ns() - start) / rounds;
+        start = now_ns();
+        for (int r = 0; r < rounds; r++) {
+            sink -= bitset_files(&ctx);
+        }
+        times[3 + 2 * sparse] = (now_ns() - start) / rounds;
+    }
+    printf("%-8s %6u inodes  free inode %9.0f ns -> %7.0f ns (%.2f -> %.3f ns/inode)   files, full %9.0f ns -> %8.0f ns   "
+           "files, 1/16 used %8.0f ns -> %7.0f ns%s\n",
+           label, num_inodes, times[0], times[1], times[0] / num_inodes, times[1] / num_inodes, times[2], times[3], times[4],
+           times[5], sink == 2 * rounds * (int)(num_inodes - 1) ? "" : " (mismatch)");
+    free_context(&ctx);
+    fclose(null_stream);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: inode-scan <disk name>\n");
+        return 1;
+    }
+    if (format_disk(argv[1], 1, 0, 0, 0, 0) != 0) {
+        fprintf(stderr, "Error: Cannot format %s\n", argv[1]);
+        return 1;
+    }
+    time_table("v1", argv[1]);
+    for (uint32_t inodes = 1024; inodes <= 65536; inodes *= 4) {
+        if (format_disk(argv[1], 2, 4096, 16384, inodes, 0) != 0) {
+            fprintf(stderr, "Error: Cannot format %s\n", argv[1]);
+            return 1;
+        }
+        time_table("v2", argv[1]);
+    }
+    unlink(argv[1]);
+    return 0;
+}
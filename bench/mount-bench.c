@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs-context.h"
+
+// Measures check_consistency and fs_mount latency on worst-case (but consistent) inode tables,
+// and how both scale on a large version 2 disk
+
+#define ITERATIONS 20000
+
+static FsContext ctx;
+
+// Returns the current monotonic time in nanoseconds
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Fills a used inode with a unique 5-character name
+static void make_inode(SuperblockV1 *sb, int i, int parent, bool is_dir, int start, int size) {
+    snprintf(sb->inode[i].name, 5, "n%03d", i); // Truncated to 4 characters plus a zero byte
+    sb->inode[i].isused_size = 0x80 | size;
+    sb->inode[i].start_block = start;
+    sb->inode[i].isdir_parent = (is_dir ? 0x80 : 0) | parent;
+    for (int b = start; b < start + size; b++) {
+        sb->free_block_list[b / 8] |= 1 << (7 - b % 8);
+    }
+}
+
+// One directory in the root holding 125 one-block files: the worst case for the unique name check
+static void build_wide(SuperblockV1 *sb) {
+    make_inode(sb, 0, 127, true, 0, 0);
+    for (int i = 1; i < 126; i++) {
+        make_inode(sb, i, 0, false, i, 1);
+    }
+}
+
+// 63 directories, each holding one one-block file
+static void build_many_dirs(SuperblockV1 *sb) {
+    for (int i = 0; i < 63; i++) {
+        make_inode(sb, i, 127, true, 0, 0);
+        make_inode(sb, 63 + i, i, false, 1 + i, 1);
+    }
+}
+
+// A chain of 126 nested directories
+static void build_deep(SuperblockV1 *sb) {
+    for (int i = 0; i < 126; i++) {
+        make_inode(sb, i, i == 0 ? 127 : i - 1, true, 0, 0);
+    }
+}
+
+// Times check_consistency and fs_mount on the disk in disk_name
+static void time_disk(const char *label, char *disk_name, int iterations) {
+    int fd = open(disk_name, O_RDONLY);
+    Superblock sb;
+    if (fd == -1 || load_superblock(fd, &sb) != 0) {
+        fprintf(stderr, "%s: cannot load the superblock\n", label);
+        exit(1);
+    }
+    close(fd);
+    if (check_consistency(&ctx, &sb, disk_name) != 0) {
+        fprintf(stderr, "%s: table is not consistent\n", label);
+        exit(1);
+    }
+    double start = now_ns();
+    int sink = 0;
+    for (int i = 0; i < iterations; i++) {
+        sink += check_consistency(&ctx, &sb, disk_name);
+    }
+    double check_ns = (now_ns() - start) / iterations;
+    free_superblock(&sb);
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        fs_mount(&ctx, disk_name);
+    }
+    double mount_ns = (now_ns() - start) / iterations;
+    free_context(&ctx);
+    printf("%-10s check_consistency %11.0f ns   fs_mount %11.0f ns%s\n", label, check_ns, mount_ns, sink ? " (inconsistent)" : "");
+}
+
+static void run_case(const char *label, void (*build)(SuperblockV1 *)) {
+    SuperblockV1 sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.free_block_list[0] = 0x80; // Block 0 holds the superblock
+    build(&sb);
+    char disk_name[] = "/tmp/mount-bench-XXXXXX";
+    int fd = mkstemp(disk_name);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    uint8_t image[128 * 1024] = {0};
+    memcpy(image, &sb, sizeof(sb));
+    if (write(fd, image, sizeof(image)) != sizeof(image)) {
+        perror("write");
+        exit(1);
+    }
+    close(fd);
+    time_disk(label, disk_name, ITERATIONS);
+    unlink(disk_name);
+}
+
+// A version 2 disk with 65536 4 KiB blocks: 4095 directories in the root, each holding three one-block files
+static void run_large_case(void) {
+    char disk_name[] = "/tmp/mount-bench-XXXXXX";
+    int fd = mkstemp(disk_name);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    if (format_disk(disk_name, 2, 4096, 65536, 16380, 0) != 0) {
+        fprintf(stderr, "v2-large: cannot format the disk\n");
+        exit(1);
+    }
+    fs_mount(&ctx, disk_name);
+    Superblock *superblock = &ctx.volume->superblock;
+    uint32_t block = superblock->data_start;
+    for (uint32_t dir = 0; dir < 4095; dir++) {
+        Inode *inode = &superblock->inode[dir];
+        snprintf(inode->name, 5, "d%03x", dir);
+        inode->isused_size = INODE_USED;
+        inode->isdir_parent = INODE_DIR | superblock->root;
+        for (uint32_t k = 1; k <= 3; k++) {
+            inode = &superblock->inode[4095 * k + dir];
+            snprintf(inode->name, 5, "f%u", k);
+            inode->isused_size = INODE_USED | 1;
+            inode->start_block = block;
+            inode->isdir_parent = dir;
+            update_free_blocks(&ctx, block++, 1, true);
+        }
+    }
+    for (uint32_t i = 0; i < superblock->num_inodes; i++) {
+        mark_inode_dirty(&ctx, i);
+    }
+    free_context(&ctx); // Writes the table back
+
+    time_disk("v2-large", disk_name, 20);
+    unlink(disk_name);
+}
+
+int main(void) {
+    init_context(&ctx, stdout, stderr);
+    run_case("wide", build_wide);
+    run_case("many-dirs", build_many_dirs);
+    run_case("deep", build_deep);
+    run_large_case();
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "command-processor.h"
+#include "fs-context.h"
+
+// Usage: parse-bench [lines] [scratch file]
+// Measures parsing alone: writes a large command file of valid commands, then times check_command_file (which
+// tokenizes and validates every line without running it) against the fgets + sscanf + strcmp loop it replaced
+
+#define DEFAULT_LINES 2000000
+
+// Returns the current monotonic time in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes a replay-style command file; returns its size in bytes
+static long write_commands(const char *filename, long lines) {
+    static const char *names[] = {"a", "bb", "ccc", "dddd", "eeeee", "f1", "g22", "dir"};
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        return -1;
+    }
+    unsigned seed = 1;
+    for (long i = 0; i < lines; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned pick = seed >> 16;
+        const char *name = names[pick % 8];
+        switch ((pick / 8) % 10) {
+        case 0: fprintf(out, "C %s %u\n", name, pick % 100); break;
+        case 1: fprintf(out, "D %s\n", name); break;
+        case 2:
+        case 3: fprintf(out, "R %s %u\n", name, pick % 120); break;
+        case 4: fprintf(out, "W %s %u %u\n", name, pick % 60, 1 + pick % 8); break;
+        case 5: fprintf(out, "B the quick brown fox %u jumps over the lazy dog\n", pick); break;
+        case 6: fprintf(out, "L\n"); break;
+        case 7: fprintf(out, "Y %s\n", pick % 2 ? name : ".."); break;
+        case 8: fprintf(out, "O %u\n", 1 + pick % 64); break;
+        default: fprintf(out, "S\n"); break;
+        }
+    }
+    long size = ftell(out);
+    fclose(out);
+    return size;
+}
+
+// The previous parser: fgets, sscanf into fixed arrays, a strcmp chain and per-branch validation (without running)
+static long legacy_check(const FsContext *ctx, const char *filename) {
+    FILE *input = fopen(filename, "r");
+    if (!input) {
+        return -1;
+    }
+    static char line[V2_MAX_BLOCK_SIZE + 16];
+    static char command[sizeof(line)], arg1[sizeof(line)], arg2[sizeof(line)], token[sizeof(line)];
+    long valid = 0;
+    while (fgets(line, sizeof(line), input)) {
+        line[strcspn(line, "\n")] = 0;
+        arg1[0] = '\0';
+        arg2[0] = '\0';
+        int args = sscanf(line, "%s %s %s", command, arg1, arg2);
+        if (args < 1) {
+            continue;
+        }
+        bool ok = false;
+        if (strcmp(command, "M") == 0) {
+            ok = args == 2;
+        } else if (strcmp(command, "C") == 0) {
+            ok = args == 3 && atoi(arg2) >= 0 && atoi(arg2) <= fs_max_file_blocks(ctx) && strlen(arg1) <= 5;
+        } else if (strcmp(command, "D") == 0 || strcmp(command, "Y") == 0) {
+            ok = args == 2 && strlen(arg1) <= 5;
+        } else if (strcmp(command, "R") == 0 || strcmp(command, "W") == 0) {
+            long count = 1;
+            if (sscanf(line, "%*s %*s %*s %s", token) == 1) {
+                char *end;
+                count = strtol(token, &end, 10);
+                if (*end != '\0' || count > fs_max_file_blocks(ctx)) {
+                    count = -1;
+                }
+            }
+            ok = args == 3 && atoi(arg2) >= 0 && atoi(arg2) < fs_max_file_blocks(ctx) && count >= 1 && strlen(arg1) <= 5;
+        } else if (strcmp(command, "B") == 0) {
+            char *content = strchr(line, ' ');
+            while (content && *content == ' ') {
+                content++;
+            }
+            ok = content && *content != '\0' && strlen(content) <= (size_t)fs_block_size(ctx);
+        } else if (strcmp(command, "L") == 0 || strcmp(command, "S") == 0 || strcmp(command, "T") == 0) {
+            char *rest = line + strlen(command);
+            while (*rest == ' ') {
+                rest++;
+            }
+            ok = *rest == '\0';
+        } else if (strcmp(command, "O") == 0) {
+            char *end;
+            long max_blocks = strtol(arg1, &end, 10);
+            ok = args == 1 || (args == 2 && *end == '\0' && max_blocks >= 1);
+        }
+        valid += ok;
+    }
+    fclose(input);
+    return valid;
+}
+
+int main(int argc, char *argv[]) {
+    long lines = argc > 1 ? atol(argv[1]) : DEFAULT_LINES;
+    const char *filename = argc > 2 ? argv[2] : "parse-bench.cmds"; // Scratch file, removed at the end
+    long size = write_commands(filename, lines);
+    if (size < 0) {
+        perror(filename);
+        return 1;
+    }
+    static FsContext ctx; // Nothing is mounted, so the limits of a version 1 disk apply
+    init_context(&ctx, stdout, stderr);
+    double start = now_seconds();
+    long legacy_valid = legacy_check(&ctx, filename);
+    double legacy_seconds = now_seconds() - start;
+    start = now_seconds();
+    long valid = check_command_file(&ctx, filename);
+    double seconds = now_seconds() - start;
+    unlink(filename);
+    if (valid != lines || legacy_valid != lines) {
+        fprintf(stderr, "parse-bench: %ld and %ld of %ld lines valid\n", valid, legacy_valid, lines);
+        return 1;
+    }
+    printf("%-18s %10.0f lines/s %8.1f MB/s\n", "fgets + sscanf", lines / legacy_seconds, size / legacy_seconds / 1e6);
+    printf("%-18s %10.0f lines/s %8.1f MB/s\n", "check_command_file", lines / seconds, size / seconds / 1e6);
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs-context.h"
+#include "prefill.h"
+
+// Measures R throughput on one mounted disk shared by 1, 2, 4, ... reader threads, each with its own context reading
+// random block ranges of random files, first alone and then while one more thread keeps writing (W) other files. Then
+// one reader reads whole files block after block (R f 0, R f 1, ...), without and with read-ahead.
+
+#define MAX_RANGE_BLOCKS 8 // Each read takes 1 to this many blocks of a file
+
+typedef struct {
+    char name[5];
+    int size; // Blocks
+} FileName;
+
+typedef struct {
+    FsContext *shared; // Context holding the mounted disk
+    const FileName *files;
+    int file_count;
+    bool writer; // Write the files instead of reading them
+    bool sequential; // Read every block of each file in order, one block per read
+    uint64_t seed;
+    unsigned long operations; // Reads or writes done
+    unsigned long blocks;     // Blocks they moved
+} Worker;
+
+static atomic_bool stop;
+
+// Returns the current monotonic time in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, one state per thread
+static uint32_t next_random(uint64_t *state, uint32_t bound) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 2685821657736338717ULL) >> 32) % bound;
+}
+
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    FILE *null_stream = fopen("/dev/null", "w");
+    FsContext *ctx = malloc(sizeof(FsContext));
+    if (!null_stream || !ctx) {
+        exit(1);
+    }
+    init_shared_context(ctx, worker->shared, null_stream, null_stream);
+    fs_buff(ctx, (const uint8_t *)"stress", 6);
+    uint64_t state = worker->seed;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        const FileName *file = &worker->files[next_random(&state, worker->file_count)];
+        if (worker->sequential) {
+            char name[5];
+            memcpy(name, file->name, 5);
+            for (int block = 0; block < file->size; block++) {
+                fs_read(ctx, name, block);
+            }
+            worker->operations += file->size;
+            worker->blocks += file->size;
+            continue;
+        }
+        int start = next_random(&state, file->size);
+        int limit = file->size - start < MAX_RANGE_BLOCKS ? file->size - start : MAX_RANGE_BLOCKS;
+        int count = 1 + next_random(&state, limit);
+        char name[5];
+        memcpy(name, file->name, 5);
+        if (worker->writer) {
+            fs_write_range(ctx, name, start, count);
+        } else {
+            fs_read_range(ctx, name, start, count);
+        }
+        worker->operations++;
+        worker->blocks += count;
+    }
+    free_context(ctx);
+    free(ctx);
+    fclose(null_stream);
+    return NULL;
+}
+
+// Runs readers (and a writer if asked) for the given time; returns the reads per second and sets the blocks per second
+static double run_round(FsContext *shared, const FileName *files, int file_count, int readers, bool writer, bool sequential,
+                        double seconds, double *blocks_per_second) {
+    int half = file_count / 2; // Readers take the first half of the files, the writer the second
+    int threads = readers + (writer ? 1 : 0);
+    Worker *workers = calloc(threads, sizeof(Worker));
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    if (!workers || !ids) {
+        exit(1);
+    }
+    atomic_store(&stop, false);
+    for (int i = 0; i < threads; i++) {
+        bool is_writer = i == readers;
+        workers[i] = (Worker){shared, is_writer ? files + half : files, is_writer ? file_count - half : half, is_writer,
+                              sequential, 0x9E3779B97F4A7C15ULL * (i + 1), 0, 0};
+    }
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, run_worker, &workers[i]) != 0) {
+            exit(1);
+        }
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    atomic_store(&stop, true);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    unsigned long reads = 0;
+    unsigned long blocks = 0;
+    for (int i = 0; i < readers; i++) {
+        reads += workers[i].operations;
+        blocks += workers[i].blocks;
+    }
+    free(ids);
+    free(workers);
+    *blocks_per_second = blocks / elapsed;
+    return reads / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = 0.2;
+    int option;
+    while ((option = getopt(argc, argv, "t:s:")) != -1) {
+        switch (option) {
+        case 't': max_threads = atol(optarg); break;
+        case 's': seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: read-stress [-t max threads] [-s seconds per round] <disk name>\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || max_threads < 1 || seconds <= 0) {
+        fprintf(stderr, "Usage: read-stress [-t max threads] [-s seconds per round] <disk name>\n");
+        return 1;
+    }
+    if (max_threads < 4) {
+        max_threads = 4; // Show contention even on small machines
+    }
+    char *disk_name = argv[optind];
+    // 64 MB version 2 disk holding 2000 files of 1 to 32 blocks in the root directory
+    if (format_disk(disk_name, 2, 1024, 65536, 4096, 0) != 0) {
+        fprintf(stderr, "Error: Cannot format %s\n", disk_name);
+        return 1;
+    }
+    static FsContext shared;
+    init_context(&shared, stdout, stderr);
+    fs_mount(&shared, disk_name);
+    if (!shared.volume->is_mounted) {
+        return 1;
+    }
+    seed_random(1);
+    PrefillOptions prefill = {2000, 0, 32, 0, 0};
+    prefill_disk(&shared, &prefill);
+    fs_sync(&shared);
+    FileName *files = malloc(shared.volume->superblock.num_inodes * sizeof(FileName));
+    if (!files) {
+        return 1;
+    }
+    int file_count = 0;
+    for (int i = first_child_of(&shared, shared.volume->superblock.root); i != -1; i = next_child(&shared, i)) {
+        const Inode *inode = &shared.volume->superblock.inode[i];
+        if (!(inode->isdir_parent & INODE_DIR)) {
+            memcpy(files[file_count].name, inode->name, 5);
+            files[file_count++].size = inode->isused_size & INODE_FIELD_MASK;
+        }
+    }
+    printf("%ld CPUs, %d files, %.1f s per round\n", sysconf(_SC_NPROCESSORS_ONLN), file_count, seconds);
+    for (long readers = 1; readers <= max_threads; readers *= 2) {
+        double blocks_alone, blocks_with_writer;
+        double alone = run_round(&shared, files, file_count, readers, false, false, seconds, &blocks_alone);
+        double with_writer = run_round(&shared, files, file_count, readers, true, false, seconds, &blocks_with_writer);
+        printf("readers %-3ld R %9.0f /s (%6.1f MB/s)   with a writer R %9.0f /s (%6.1f MB/s)\n", readers, alone,
+               blocks_alone / 1024, with_writer, blocks_with_writer / 1024);
+    }
+    double blocks_per_second;
+    int window = read_ahead_blocks;
+    read_ahead_blocks = 0;
+    double plain = run_round(&shared, files, file_count, 1, false, true, seconds, &blocks_per_second);
+    read_ahead_blocks = window;
+    double ahead = run_round(&shared, files, file_count, 1, false, true, seconds, &blocks_per_second);
+    printf("sequential R f 0, R f 1, ...: %9.0f /s without read-ahead, %9.0f /s with (%+.1f%%)\n", plain, ahead,
+           100 * (ahead / plain - 1));
+    free(files);
+    free_context(&shared);
+    unlink(disk_name);
+    return 0;
+}
@@ -0,0 +1,304 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "fs-context.h"
+#include "trace.h"
+
+// Replays a block I/O trace recorded with FS_TRACE: it summarizes the trace, re-issues every call in order, as fast as
+// possible, against a copy of a disk image through each backend (fd with the block cache, then mmap) and reports the
+// throughput and a CRC32C of the resulting image, which must be the same for both. It then runs the read_block and
+// write_block calls through a model of the CLOCK block cache for a range of cache sizes, to pick CACHE_SIZE for the
+// workload without running its command file again.
+
+#define MIN_SIM_CACHE 8
+#define MAX_SIM_CACHE 4096
+
+// Returns the current monotonic time in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Loads every record of a trace file; returns NULL if it cannot be read or is not a trace
+static TraceRecord *load_trace(const char *filename, size_t *count) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return NULL;
+    }
+    char magic[8];
+    TraceRecord *records = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+        for (;;) {
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 65536;
+                TraceRecord *grown = realloc(records, capacity * sizeof(TraceRecord));
+                if (!grown) {
+                    break;
+                }
+                records = grown;
+            }
+            if (fread(&records[*count], sizeof(TraceRecord), 1, file) != 1) {
+                break;
+            }
+            (*count)++;
+        }
+    }
+    fclose(file);
+    if (!records) {
+        records = malloc(sizeof(TraceRecord)); // A trace with no calls is still a trace
+    }
+    return records;
+}
+
+// Copies a disk file
+static int copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int status = in == -1 || out == -1 ? -1 : 0;
+    char chunk[65536];
+    ssize_t n;
+    while (status == 0 && (n = read(in, chunk, sizeof(chunk))) > 0) {
+        if (write(out, chunk, n) != n) {
+            status = -1;
+        }
+    }
+    if (in != -1) {
+        close(in);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    return status;
+}
+
+// CRC32C of a whole file
+static uint32_t file_checksum(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    uint32_t crc = 0;
+    uint8_t chunk[65536];
+    ssize_t n;
+    while (fd != -1 && (n = read(fd, chunk, sizeof(chunk))) > 0) {
+        crc = crc32c(crc, chunk, n);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return crc;
+}
+
+// Prints the calls of the trace by kind and by the command that made them
+static void summarize(const TraceRecord *records, size_t count) {
+    unsigned long calls[256] = {0};
+    unsigned long blocks[256] = {0};
+    unsigned long by_command[256] = {0};
+    for (size_t i = 0; i < count; i++) {
+        calls[records[i].op]++;
+        blocks[records[i].op] += records[i].count;
+        by_command[(unsigned char)records[i].command]++;
+    }
+    double span = count ? records[count - 1].time_ns / 1e9 : 0;
+    printf("%zu calls over %.3f s, %lu disks attached\n", count, span, calls[TRACE_ATTACH]);
+    printf("  read_block %lu, write_block %lu, read_blocks %lu (%lu blocks), write_blocks %lu (%lu blocks), "
+           "zero_blocks %lu (%lu blocks), flushes %lu, syncs %lu\n",
+           calls[TRACE_READ], calls[TRACE_WRITE], calls[TRACE_READ_RUN], blocks[TRACE_READ_RUN], calls[TRACE_WRITE_RUN],
+           blocks[TRACE_WRITE_RUN], calls[TRACE_ZERO], blocks[TRACE_ZERO], calls[TRACE_FLUSH], calls[TRACE_SYNC]);
+    printf("  calls by command:");
+    for (int c = 1; c < 256; c++) {
+        if (by_command[c]) {
+            printf(" %c %lu", c, by_command[c]);
+        }
+    }
+    if (by_command[0]) {
+        printf(" (between commands) %lu", by_command[0]);
+    }
+    printf("\n");
+}
+
+// Makes the buffer hold at least size bytes
+static uint8_t *reserve(uint8_t *buffer, size_t *capacity, size_t size) {
+    if (size > *capacity) {
+        buffer = realloc(buffer, size);
+        if (!buffer) {
+            exit(1);
+        }
+        memset(buffer + *capacity, 0xA5, size - *capacity); // What the replayed writes store
+        *capacity = size;
+    }
+    return buffer;
+}
+
+// Issues every call of the trace against a copy of the image with the given backend; sets the elapsed seconds and the
+// bytes moved, and returns the CRC32C of the copy afterwards
+static uint32_t replay(const TraceRecord *records, size_t count, const char *image, const char *backend, double *seconds,
+                       double *bytes) {
+    char scratch[1000];
+    snprintf(scratch, sizeof(scratch), "%s.replay", image);
+    if (copy_file(image, scratch) == -1) {
+        fprintf(stderr, "Error: Cannot copy %s\n", image);
+        exit(1);
+    }
+    set_disk_backend(backend);
+    FILE *null_stream = fopen("/dev/null", "w");
+    static FsContext ctx;
+    init_context(&ctx, null_stream, null_stream);
+    uint8_t *buffer = NULL;
+    size_t capacity = 0;
+    int block_size = 0;
+    *bytes = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord *record = &records[i];
+        if (record->op == TRACE_ATTACH) {
+            int fd = open(scratch, O_RDWR);
+            if (fd == -1) {
+                exit(1);
+            }
+            attach_disk(&ctx, fd, record->block, record->count);
+            block_size = record->block;
+            continue;
+        }
+        if (block_size == 0) {
+            continue; // Nothing attached yet
+        }
+        buffer = reserve(buffer, &capacity, (size_t)(record->count ? record->count : 1) * block_size);
+        switch (record->op) {
+        case TRACE_READ: read_block(&ctx, record->block, buffer); break;
+        case TRACE_WRITE: write_block(&ctx, record->block, buffer); break;
+        case TRACE_READ_RUN: read_blocks(&ctx, record->block, record->count, buffer); break;
+        case TRACE_WRITE_RUN: write_blocks(&ctx, record->block, record->count, buffer); break;
+        case TRACE_ZERO: zero_blocks(&ctx, record->block, record->count); break;
+        case TRACE_FLUSH: flush_cache(&ctx); break;
+        case TRACE_SYNC: sync_disk(&ctx); break;
+        }
+        *bytes += (double)record->count * block_size;
+    }
+    close_disk(&ctx); // Dirty cached blocks are part of the replay
+    *seconds = now_seconds() - start;
+    free_context(&ctx);
+    fclose(null_stream);
+    free(buffer);
+    uint32_t crc = file_checksum(scratch);
+    unlink(scratch);
+    return crc;
+}
+
+// Runs the read_block and write_block calls of the trace through a model of the block cache of disk-ops.c with the
+// given number of slots: CLOCK eviction, write-back of dirty blocks on eviction, read_blocks and flushes writing back
+// what they cover, write_blocks dropping cached copies and zero_blocks leaving clean ones
+static void simulate_cache(const TraceRecord *records, size_t count, int slots, unsigned long *hits, unsigned long *misses,
+                           unsigned long *write_backs) {
+    int *slot_of = NULL; // Block -> slot + 1, 0 when not cached
+    int *block_in = malloc(slots * sizeof(int)); // Slot -> block, -1 when empty
+    bool *dirty = malloc(slots * sizeof(bool));
+    bool *referenced = malloc(slots * sizeof(bool));
+    int num_blocks = 0;
+    int hand = 0;
+    *hits = *misses = *write_backs = 0;
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord *record = &records[i];
+        if (record->op == TRACE_ATTACH) {
+            num_blocks = record->count;
+            free(slot_of);
+            slot_of = calloc(num_blocks, sizeof(int));
+            for (int s = 0; s < slots; s++) {
+                block_in[s] = -1;
+                dirty[s] = referenced[s] = false;
+            }
+            hand = 0;
+            continue;
+        }
+        if (!slot_of || record->block + (uint64_t)record->count > (uint64_t)num_blocks) {
+            continue;
+        }
+        if (record->op == TRACE_READ || record->op == TRACE_WRITE) {
+            int slot = slot_of[record->block] - 1;
+            if (slot >= 0) {
+                (*hits)++;
+            } else {
+                (*misses)++;
+                while (block_in[hand] != -1 && referenced[hand]) {
+                    referenced[hand] = false;
+                    hand = (hand + 1) % slots;
+                }
+                slot = hand;
+                if (block_in[slot] != -1) {
+                    *write_backs += dirty[slot];
+                    slot_of[block_in[slot]] = 0;
+                }
+                block_in[slot] = record->block;
+                dirty[slot] = false;
+                slot_of[record->block] = slot + 1;
+                hand = (hand + 1) % slots;
+            }
+            referenced[slot] = true;
+            dirty[slot] |= record->op == TRACE_WRITE;
+        } else if (record->op == TRACE_FLUSH) {
+            for (int s = 0; s < slots; s++) {
+                *write_backs += block_in[s] != -1 && dirty[s];
+                dirty[s] = false;
+            }
+        } else {
+            for (uint32_t block = record->block; block < record->block + record->count; block++) {
+                int slot = slot_of[block] - 1;
+                if (slot < 0) {
+                    continue;
+                }
+                if (record->op == TRACE_READ_RUN) {
+                    *write_backs += dirty[slot];
+                } else if (record->op == TRACE_WRITE_RUN) {
+                    block_in[slot] = -1;
+                    slot_of[block] = 0;
+                }
+                dirty[slot] = false;
+            }
+        }
+    }
+    free(slot_of);
+    free(block_in);
+    free(dirty);
+    free(referenced);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: trace-replay <trace file> <disk image>\n");
+        return 1;
+    }
+    size_t count;
+    TraceRecord *records = load_trace(argv[1], &count);
+    if (!records) {
+        fprintf(stderr, "Error: Cannot read trace %s\n", argv[1]);
+        return 1;
+    }
+    printf("%s: ", argv[1]);
+    summarize(records, count);
+    const char *backends[] = {"fd", "mmap"};
+    uint32_t crcs[2];
+    for (int b = 0; b < 2; b++) {
+        double seconds, bytes;
+        crcs[b] = replay(records, count, argv[2], backends[b], &seconds, &bytes);
+        printf("replay %-4s: %.3f s, %.0f calls/s, %.1f MB/s, image crc32c %08x\n", backends[b], seconds, count / seconds,
+               bytes / seconds / 1e6, crcs[b]);
+    }
+    if (crcs[0] != crcs[1]) {
+        printf("Error: the backends left different images\n");
+    }
+    printf("simulated block cache (read_block and write_block calls):\n");
+    printf("  slots        hits      misses  write-backs  hit rate\n");
+    for (int slots = MIN_SIM_CACHE; slots <= MAX_SIM_CACHE; slots *= 2) {
+        unsigned long hits, misses, write_backs;
+        simulate_cache(records, count, slots, &hits, &misses, &write_backs);
+        printf("  %5d%c %11lu %11lu  %11lu  %7.2f%%\n", slots, slots == CACHE_SIZE ? '*' : ' ', hits, misses, write_backs,
+               hits + misses ? 100.0 * hits / (hits + misses) : 0);
+    }
+    printf("  (* CACHE_SIZE of this build)\n");
+    free(records);
+    return crcs[0] != crcs[1];
+}
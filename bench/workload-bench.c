@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "command-processor.h"
+#include "fs-context.h"
+
+// Runs workloads made by gen-workload through process_command_file in-process, each on a fresh copy of its disk, and
+// reports throughput, per-command latency percentiles and disk I/O as JSON. With -b, fails when a deterministic block
+// counter exceeds a baseline file, and only warns when throughput falls under half of its baseline.
+
+#define COMMAND_TYPES 128 // Latencies are kept per first character of the command
+
+typedef struct {
+    long long *samples; // Latency of each command, in nanoseconds
+    int count;
+    int capacity;
+} LatencySamples;
+
+static LatencySamples latencies[COMMAND_TYPES];
+
+// Records the latency of one command (the command observer of process_command_file)
+static void record_latency(const char *command, long long elapsed_ns) {
+    LatencySamples *samples = &latencies[(unsigned char)command[0] % COMMAND_TYPES];
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->samples = realloc(samples->samples, samples->capacity * sizeof(long long));
+        if (!samples->samples) {
+            exit(1);
+        }
+    }
+    samples->samples[samples->count++] = elapsed_ns;
+}
+
+static int compare_long_longs(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Returns the p-th percentile (nearest rank) of sorted samples
+static long long percentile(const LatencySamples *samples, int p) {
+    int rank = (samples->count * p + 99) / 100;
+    return samples->samples[rank > 0 ? rank - 1 : 0];
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Finds a numeric field of a workload's object in a baseline file written by this program; returns -1 if absent
+static double baseline_value(const char *baseline, const char *workload, const char *key) {
+    char pattern[256];
+    snprintf(pattern, sizeof(pattern), "\"workload\": \"%s\"", workload);
+    const char *object = strstr(baseline, pattern);
+    if (!object) {
+        return -1;
+    }
+    const char *next_object = strstr(object + 1, "\"workload\": ");
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *field = strstr(object, pattern);
+    if (!field || (next_object && field > next_object)) {
+        return -1;
+    }
+    return strtod(field + strlen(pattern), NULL);
+}
+
+// Copies a disk file
+static int copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int status = in == -1 || out == -1 ? -1 : 0;
+    char chunk[65536];
+    ssize_t n;
+    while (status == 0 && (n = read(in, chunk, sizeof(chunk))) > 0) {
+        if (write(out, chunk, n) != n) {
+            status = -1;
+        }
+    }
+    if (in != -1) {
+        close(in);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    return status;
+}
+
+// Reads a whole file into a zero-terminated string
+static char *read_file(const char *name) {
+    FILE *file = fopen(name, "r");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = malloc(length + 1);
+    if (text && fread(text, 1, length, file) != (size_t)length) {
+        free(text);
+        text = NULL;
+    }
+    if (text) {
+        text[length] = '\0';
+    }
+    fclose(file);
+    return text;
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline_name = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "b:")) != -1) {
+        if (option != 'b') {
+            fprintf(stderr, "Usage: workload-bench [-b baseline.json] <workload prefix>...\n");
+            return 1;
+        }
+        baseline_name = optarg;
+    }
+    char *baseline = baseline_name ? read_file(baseline_name) : NULL;
+    if (baseline_name && !baseline) {
+        fprintf(stderr, "workload-bench: cannot read %s\n", baseline_name);
+    }
+    // The file system's own output (listings, expected errors) is not part of the measurement
+    FILE *null_stream = fopen("/dev/null", "w");
+    if (!null_stream) {
+        return 1;
+    }
+    static FsContext ctx;
+    int regressions = 0;
+    printf("[\n");
+    for (int w = optind; w < argc; w++) {
+        const char *workload = strrchr(argv[w], '/') ? strrchr(argv[w], '/') + 1 : argv[w];
+        char disk_name[1000], run_name[1000], commands_name[1000];
+        snprintf(disk_name, sizeof(disk_name), "%s.disk", argv[w]);
+        snprintf(run_name, sizeof(run_name), "%s.run", argv[w]);
+        snprintf(commands_name, sizeof(commands_name), "%s.cmds", argv[w]);
+        // The commands modify the disk, so every run starts from the generated image
+        if (copy_file(disk_name, run_name) == -1) {
+            fprintf(stderr, "workload-bench: cannot copy %s\n", disk_name);
+            return 1;
+        }
+        for (int i = 0; i < COMMAND_TYPES; i++) {
+            latencies[i].count = 0;
+        }
+        init_context(&ctx, null_stream, null_stream);
+        command_observer = record_latency;
+        double start = now_seconds();
+        process_command_file(&ctx, commands_name);
+        double elapsed = now_seconds() - start;
+        command_observer = NULL;
+        const IoStats *io_stats = &ctx.io_stats;
+        long total = 0;
+        for (int i = 0; i < COMMAND_TYPES; i++) {
+            total += latencies[i].count;
+        }
+        unsigned long blocks_read = io_stats->bytes_read / ctx.volume->superblock.block_size;
+        unsigned long blocks_written = io_stats->bytes_written / ctx.volume->superblock.block_size;
+        double ops_per_sec = elapsed > 0 ? total / elapsed : 0;
+        printf("  {\"workload\": \"%s\", \"commands\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+               "\"blocks_read\": %lu, \"blocks_written\": %lu, \"read_calls\": %lu, \"write_calls\": %lu,\n",
+               workload, total, elapsed, ops_per_sec, blocks_read, blocks_written, io_stats->reads, io_stats->writes);
+        printf("   \"per_command\": {");
+        bool first = true;
+        for (int i = 0; i < COMMAND_TYPES; i++) {
+            if (latencies[i].count == 0) {
+                continue;
+            }
+            qsort(latencies[i].samples, latencies[i].count, sizeof(long long), compare_long_longs);
+            printf("%s\"%c\": {\"count\": %d, \"p50_ns\": %lld, \"p99_ns\": %lld}", first ? "" : ", ", i, latencies[i].count,
+                   percentile(&latencies[i], 50), percentile(&latencies[i], 99));
+            first = false;
+        }
+        printf("}}%s\n", w + 1 < argc ? "," : "");
+        free_context(&ctx);
+        if (baseline) {
+            // Block counts are deterministic for a fixed seed, so any growth is a change in allocation or defrag behaviour
+            // and fails the run; throughput depends on the machine, so a large drop is only reported
+            double base_read = baseline_value(baseline, workload, "blocks_read");
+            double base_written = baseline_value(baseline, workload, "blocks_written");
+            double base_ops = baseline_value(baseline, workload, "ops_per_sec");
+            if (base_read >= 0 && blocks_read > base_read) {
+                fprintf(stderr, "REGRESSION %s: blocks_read %lu > baseline %.0f\n", workload, blocks_read, base_read);
+                regressions++;
+            }
+            if (base_written >= 0 && blocks_written > base_written) {
+                fprintf(stderr, "REGRESSION %s: blocks_written %lu > baseline %.0f\n", workload, blocks_written, base_written);
+                regressions++;
+            }
+            if (base_ops > 0 && ops_per_sec < base_ops / 2) {
+                fprintf(stderr, "warning %s: %.0f ops/sec, under half of baseline %.0f\n", workload, ops_per_sec, base_ops);
+            }
+        }
+    }
+    printf("]\n");
+    fclose(null_stream);
+    free(baseline);
+    return regressions > 0;
+}
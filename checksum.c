@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <string.h>
+#include "checksum.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC32C (Castagnoli polynomial, reflected), the checksum of the metadata journal and of data blocks. On x86-64 CPUs
+// with SSE4.2 it runs on the crc32 instruction, 8 bytes at a time, over three interleaved streams so the instruction's
+// latency is hidden, then combines them; elsewhere it uses a slice-by-8 table, which folds 8 bytes per step through 8
+// lookups. FS_CRC32C=table selects the table on any CPU, for comparing the two.
+
+#define CRC32C_POLY 0x82F63B78u
+#define STREAM_BYTES 256 // Bytes of each of the three interleaved streams (a power of two)
+
+typedef uint32_t (*Crc32cImpl)(uint32_t crc, const uint8_t *data, size_t length);
+
+static uint32_t crc_table[8][256]; // crc_table[k][b]: CRC of byte b followed by k zero bytes
+static uint32_t shift_table[4][256]; // shift_table[k][b]: CRC register byte k holding b, after STREAM_BYTES zero bytes
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static Crc32cImpl crc32c_impl = NULL; // Chosen at the first call unless set_checksum_impl picked one
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+// Multiplies a 32x32 matrix over GF(2) (one column per word) by a vector
+static uint32_t gf2_times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+// Fills shift_table from the operator that feeds STREAM_BYTES zero bytes through the CRC register: the one for a single
+// zero bit, squared until it covers 8 * STREAM_BYTES bits
+static void build_shift_table(void) {
+    uint32_t op[32];
+    uint32_t square[32];
+    op[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        op[n] = 1u << (n - 1);
+    }
+    for (uint32_t bits = 1; bits < 8 * STREAM_BYTES; bits *= 2) {
+        gf2_square(square, op);
+        memcpy(op, square, sizeof(op));
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            shift_table[k][b] = gf2_times(op, b << (8 * k));
+        }
+    }
+}
+
+static void build_table(void) {
+    build_shift_table();
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc >> 1 ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            crc_table[k][b] = crc_table[k - 1][b] >> 8 ^ crc_table[0][crc_table[k - 1][b] & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *data, size_t length) {
+    pthread_once(&table_once, build_table);
+    while (length > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = crc >> 8 ^ crc_table[0][(crc ^ *data++) & 0xFF];
+        length--;
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word)); // Little-endian: the first byte is the low byte
+        word ^= crc;
+        crc = crc_table[7][word & 0xFF] ^ crc_table[6][(word >> 8) & 0xFF] ^ crc_table[5][(word >> 16) & 0xFF] ^
+              crc_table[4][(word >> 24) & 0xFF] ^ crc_table[3][(word >> 32) & 0xFF] ^ crc_table[2][(word >> 40) & 0xFF] ^
+              crc_table[1][(word >> 48) & 0xFF] ^ crc_table[0][word >> 56];
+    }
+    while (length-- > 0) {
+        crc = crc >> 8 ^ crc_table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Register after STREAM_BYTES zero bytes
+static inline uint32_t shift_stream(uint32_t crc) {
+    return shift_table[0][crc & 0xFF] ^ shift_table[1][(crc >> 8) & 0xFF] ^ shift_table[2][(crc >> 16) & 0xFF] ^
+           shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+    pthread_once(&table_once, build_table);
+    uint64_t crc64 = crc;
+    // Three streams of STREAM_BYTES at a time: the CRC of the whole is the first one's register shifted past the second
+    // stream and combined with it, then shifted past the third and combined with that
+    for (; length >= 3 * STREAM_BYTES; length -= 3 * STREAM_BYTES, data += 3 * STREAM_BYTES) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        for (size_t i = 0; i < STREAM_BYTES; i += 8) {
+            uint64_t words[3];
+            memcpy(&words[0], data + i, 8);
+            memcpy(&words[1], data + STREAM_BYTES + i, 8);
+            memcpy(&words[2], data + 2 * STREAM_BYTES + i, 8);
+            crc64 = _mm_crc32_u64(crc64, words[0]);
+            crc1 = _mm_crc32_u64(crc1, words[1]);
+            crc2 = _mm_crc32_u64(crc2, words[2]);
+        }
+        crc64 = shift_stream((uint32_t)crc64) ^ (uint32_t)crc1;
+        crc64 = shift_stream((uint32_t)crc64) ^ (uint32_t)crc2;
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// The fastest implementation this CPU supports
+static Crc32cImpl best_impl(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_table;
+}
+
+static void choose_impl(void) {
+    if (!crc32c_impl) {
+        crc32c_impl = best_impl();
+    }
+}
+
+// Extends a CRC32C over length more bytes (start from 0)
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&impl_once, choose_impl);
+    return ~crc32c_impl(~crc, data, length);
+}
+
+// Selects the implementation by name ("hardware" or "table"); returns -1 for an unknown name or one this CPU lacks.
+// Call it before any thread computes a checksum.
+int set_checksum_impl(const char *name) {
+    if (strcmp(name, "table") == 0) {
+        crc32c_impl = crc32c_table;
+        return 0;
+    }
+    if (strcmp(name, "hardware") == 0 && best_impl() != crc32c_table) {
+        crc32c_impl = best_impl();
+        return 0;
+    }
+    return -1;
+}
+
+// Name of the implementation in use
+const char *checksum_impl_name(void) {
+    pthread_once(&impl_once, choose_impl);
+    return crc32c_impl == crc32c_table ? "table" : "hardware";
+}
@@ -0,0 +1,10 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+int set_checksum_impl(const char *name);
+const char *checksum_impl_name(void);
+
+#endif
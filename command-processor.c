@@ -1,167 +1,465 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
-#include "fs-sim.h"
-#include "disk-ops.h"
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "command-processor.h"
+#include "fs-context.h"
 
-// This function reads commands from a file and executes corresponding file system operations
-void process_command_file(const char* filename) {
-    FILE *input = fopen(filename, "r"); // Open the command file for reading
-    if (!input) {
-        return; // Silently return if file can't be opened
+// Size of the fgets buffer lines were read into; a line longer than it less one is split into several numbered lines
+#define LINE_BUFFER 1100
+#define MAX_TOKENS 4 // Command, two arguments, and the block count of R and W
+
+CommandObserver command_observer = NULL; // Told the latency of every command when set
+
+// Whole command file in memory: mapped when possible, read into a buffer otherwise
+typedef struct {
+    const char *data;
+    size_t size;
+    bool mapped;
+} CommandInput;
+
+typedef struct {
+    const char *text; // Start of the token in the input (not terminated)
+    int length;
+} Token;
+
+// One line of the command file, split into whitespace-separated tokens in place
+typedef struct {
+    const char *text; // Line without its newline (not terminated)
+    int length;
+    Token token[MAX_TOKENS];
+    int tokens;       // Tokens found, at most MAX_TOKENS
+    int args;         // Tokens counted for validation, at most 3 (a fourth is only read by R and W)
+} CommandLine;
+
+// Arguments of a validated command, ready to run
+typedef struct {
+    char name[5];        // File or directory name (the last component of a path), zero padded
+    const char *directory; // Directory part of a path argument (not terminated)
+    int directory_length;  // Its length, 0 for a bare name
+    int number;          // C size, R/W first block, O block budget (0 for a full defragmentation)
+    int count;           // R/W block count
+    const uint8_t *data; // B content, M disk name (not terminated)
+    int length;          // Its length
+} Arguments;
+
+typedef struct {
+    bool (*parse)(const FsContext *ctx, const CommandLine *line, Arguments *arguments); // Command-specific validation, NULL if none
+    void (*run)(FsContext *ctx, Arguments *arguments);
+    int args;   // Tokens required (command included, counted up to 3), 0 if the command checks its own
+    bool bare;  // Nothing may follow the command
+    bool named; // The first argument is a path whose components are names of at most 5 characters
+} CommandSpec;
+
+// True for the characters sscanf's %s stops at (isspace in the C locale)
+static inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Converts a token as strtol does in base 10 (optional sign, digits, saturating on overflow); *complete is set if
+// the whole token was consumed
+static long token_to_long(const Token *token, bool *complete) {
+    int i = 0;
+    bool negative = false;
+    if (i < token->length && (token->text[i] == '+' || token->text[i] == '-')) {
+        negative = token->text[i] == '-';
+        i++;
+    }
+    int first_digit = i;
+    unsigned long value = 0;
+    unsigned long limit = negative ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+    bool overflow = false;
+    for (; i < token->length && token->text[i] >= '0' && token->text[i] <= '9'; i++) {
+        int digit = token->text[i] - '0';
+        if (overflow || value > (limit - digit) / 10) {
+            overflow = true;
+        } else {
+            value = value * 10 + digit;
+        }
+    }
+    if (i == first_digit) {
+        *complete = token->length == 0; // No digits: strtol stops at the start of the token
+        return 0;
+    }
+    *complete = i == token->length;
+    if (overflow) {
+        return negative ? LONG_MIN : LONG_MAX;
+    }
+    return negative ? (long)(0 - value) : (long)value;
+}
+
+// Converts a token as atoi does
+static int token_to_int(const Token *token) {
+    bool complete;
+    return (int)token_to_long(token, &complete);
+}
+
+// True if nothing but spaces follows the command; like the original check, measured from the start of the line
+static bool rest_is_empty(const CommandLine *line) {
+    int i = line->token[0].length;
+    while (i < line->length && line->text[i] == ' ') {
+        i++; // Skip spaces
+    }
+    return i == line->length;
+}
+
+// Returns the block count given as the fourth token of an R or W line: 1 if there is none, -1 if it is not a valid count
+static int parse_block_count(const FsContext *ctx, const CommandLine *line) {
+    if (line->tokens < 4) {
+        return 1; // Single block
+    }
+    bool complete;
+    long count = token_to_long(&line->token[3], &complete);
+    if (!complete || count < 1 || count > fs_max_file_blocks(ctx)) {
+        return -1;
+    }
+    return count;
+}
+
+// Splits a path argument (a name, or names separated by '/', optionally starting with '/' for a path from the root)
+// into its directory part and its last name; "/" alone stands for the root itself. Every name must have 1 to 5
+// characters.
+static bool parse_path(const Token *token, Arguments *arguments) {
+    const char *path = token->text;
+    int length = token->length;
+    int name_start = 0;
+    if (length == 1 && path[0] == '/') {
+        path = "/.";
+        length = 2;
+    }
+    for (int i = 0; i < length; i++) {
+        if (path[i] == '/') {
+            // Validate the length of each directory name (1-5 characters; a leading '/' has nothing before it)
+            if ((i == name_start && i > 0) || i - name_start > 5) {
+                return false;
+            }
+            name_start = i + 1;
+        }
+    }
+    int name_length = length - name_start;
+    if (name_length < 1 || name_length > 5) {
+        return false;
+    }
+    memset(arguments->name, 0, sizeof(arguments->name));
+    memcpy(arguments->name, path + name_start, name_length);
+    arguments->directory = path;
+    arguments->directory_length = name_start > 1 ? name_start - 1 : name_start; // "a/b" of a/b/f, "/" of /f
+    return true;
+}
+
+static bool parse_mount(const FsContext *ctx, const CommandLine *line, Arguments *arguments) {
+    arguments->data = (const uint8_t *)line->token[1].text;
+    arguments->length = line->token[1].length;
+    return true;
+}
+
+static bool parse_create(const FsContext *ctx, const CommandLine *line, Arguments *arguments) {
+    arguments->number = token_to_int(&line->token[2]);
+    // Validate file size (0-127 blocks on a version 1 disk)
+    return arguments->number >= 0 && arguments->number <= fs_max_file_blocks(ctx);
+}
+
+static bool parse_block_range(const FsContext *ctx, const CommandLine *line, Arguments *arguments) {
+    arguments->number = token_to_int(&line->token[2]);
+    arguments->count = parse_block_count(ctx, line);
+    // Validate block number (0-126 on a version 1 disk) and block count
+    return arguments->number >= 0 && arguments->number < fs_max_file_blocks(ctx) && arguments->count >= 1;
+}
+
+static bool parse_buffer(const FsContext *ctx, const CommandLine *line, Arguments *arguments) {
+    // Special handling for buffer command as it can contain spaces
+    const char *first_space = memchr(line->text, ' ', line->length);
+    if (!first_space) {
+        return false;
+    }
+    const char *end = line->text + line->length;
+    const char *content_start = first_space; // Find the buffer content after the command
+    while (content_start < end && *content_start == ' ') {
+        content_start++; // Skip additional spaces
+    }
+    // Check if there's actually content after skipping spaces, and that it fits in a block (1024 bytes on a version 1 disk)
+    arguments->data = (const uint8_t *)content_start;
+    arguments->length = end - content_start;
+    return arguments->length > 0 && arguments->length <= fs_block_size(ctx);
+}
+
+static bool parse_defrag(const FsContext *ctx, const CommandLine *line, Arguments *arguments) {
+    arguments->number = 0;
+    if (rest_is_empty(line)) {
+        return true; // Full defragmentation
+    }
+    // If there's anything left after the command, it must be a single block budget
+    bool complete;
+    long max_blocks = line->args >= 2 ? token_to_long(&line->token[1], &complete) : 0;
+    if (line->args != 2 || !complete || max_blocks < 1) {
+        return false;
+    }
+    arguments->number = max_blocks > INT_MAX ? INT_MAX : (int)max_blocks;
+    return true;
+}
+
+static void run_mount(FsContext *ctx, Arguments *arguments) {
+    char *disk_name = strndup((const char *)arguments->data, arguments->length); // fs_mount takes a terminated name
+    if (disk_name) {
+        fs_mount(ctx, disk_name);
     }
-    char line[1100]; // Buffer size
+    free(disk_name);
+}
+
+static void run_create(FsContext *ctx, Arguments *arguments) {
+    fs_create(ctx, arguments->name, arguments->number);
+}
+
+static void run_delete(FsContext *ctx, Arguments *arguments) {
+    fs_delete(ctx, arguments->name);
+}
+
+static void run_read(FsContext *ctx, Arguments *arguments) {
+    fs_read_range(ctx, arguments->name, arguments->number, arguments->count);
+}
+
+static void run_write(FsContext *ctx, Arguments *arguments) {
+    fs_write_range(ctx, arguments->name, arguments->number, arguments->count);
+}
+
+static void run_buffer(FsContext *ctx, Arguments *arguments) {
+    fs_buff(ctx, arguments->data, arguments->length);
+}
+
+static void run_list(FsContext *ctx, Arguments *arguments) {
+    fs_ls(ctx);
+}
+
+static void run_defrag(FsContext *ctx, Arguments *arguments) {
+    if (arguments->number > 0) {
+        fs_defrag_step(ctx, arguments->number);
+    } else {
+        fs_defrag(ctx);
+    }
+}
+
+static void run_sync(FsContext *ctx, Arguments *arguments) {
+    fs_sync(ctx);
+}
+
+static void run_stats(FsContext *ctx, Arguments *arguments) {
+    print_stats(ctx);
+}
+
+static void run_scrub(FsContext *ctx, Arguments *arguments) {
+    fs_scrub(ctx);
+}
+
+static void run_cd(FsContext *ctx, Arguments *arguments) {
+    fs_cd(ctx, arguments->name);
+}
+
+// Commands by their letter; a command is always a single character
+static const CommandSpec command_table[UCHAR_MAX + 1] = {
+    ['M'] = {parse_mount, run_mount, 2, false, false},       // Mount the file system found on disk
+    ['C'] = {parse_create, run_create, 3, false, true},      // Create a file
+    ['D'] = {NULL, run_delete, 2, false, true},              // Delete a file
+    ['R'] = {parse_block_range, run_read, 3, false, true},   // Read from a file (4 tokens for a range of blocks)
+    ['W'] = {parse_block_range, run_write, 3, false, true},  // Write to a file (4 tokens for a range of blocks)
+    ['B'] = {parse_buffer, run_buffer, 0, false, false},     // Update the buffer
+    ['L'] = {NULL, run_list, 0, true, false},                // List files
+    ['O'] = {parse_defrag, run_defrag, 0, false, false},     // Defragment the disk, optionally within a block budget
+    ['S'] = {NULL, run_sync, 0, true, false},                // Write pending changes to the disk
+    ['T'] = {NULL, run_stats, 0, true, false},               // Print file system statistics
+    ['V'] = {NULL, run_scrub, 0, true, false},               // Verify every checksummed block of the disk
+    ['Y'] = {NULL, run_cd, 2, false, true},                  // Change the current working directory
+};
+
+// Returns the longest line handled as one command: 1099 characters as with the LINE_BUFFER fgets buffer, or, when the
+// mounted disk has blocks too large for it, enough for a B command filling a block
+static size_t max_line(const FsContext *ctx) {
+    size_t buffer = fs_block_size(ctx) + 16;
+    return (buffer > LINE_BUFFER ? buffer : LINE_BUFFER) - 1;
+}
+
+// Finds the next line at *pos, as fgets into a max_line + 1 byte buffer followed by stripping the newline would see
+// it, and advances *pos past it
+static void next_line(const FsContext *ctx, const CommandInput *input, size_t *pos, CommandLine *line) {
+    const char *start = input->data + *pos;
+    size_t limit = input->size - *pos < max_line(ctx) ? input->size - *pos : max_line(ctx);
+    const char *newline = memchr(start, '\n', limit);
+    size_t length = newline ? (size_t)(newline - start) : limit;
+    *pos += newline ? length + 1 : length;
+    const char *zero = memchr(start, '\0', length); // A line is a C string, anything after a zero byte is ignored
+    line->text = start;
+    line->length = zero ? zero - start : (int)length;
+}
+
+// Splits a line into whitespace-separated tokens, as sscanf with %s would
+static void tokenize(CommandLine *line) {
+    const char *p = line->text;
+    const char *end = line->text + line->length;
+    line->tokens = 0;
+    while (line->tokens < MAX_TOKENS) {
+        while (p < end && is_space(*p)) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        Token *token = &line->token[line->tokens++];
+        token->text = p;
+        while (p < end && !is_space(*p)) {
+            p++;
+        }
+        token->length = p - token->text;
+    }
+    line->args = line->tokens < 3 ? line->tokens : 3;
+}
+
+// Validates a line against its command's rules; returns the command, or NULL for a command error
+static const CommandSpec *validate(const FsContext *ctx, const CommandLine *line, Arguments *arguments) {
+    const CommandSpec *spec = line->token[0].length == 1 ? &command_table[(unsigned char)line->token[0].text[0]] : NULL;
+    if (!spec || !spec->run) {
+        return NULL; // Unknown command
+    }
+    if ((spec->args && line->args != spec->args) || (spec->bare && !rest_is_empty(line))) {
+        return NULL;
+    }
+    arguments->directory_length = 0;
+    if (spec->named && !parse_path(&line->token[1], arguments)) {
+        return NULL;
+    }
+    if (spec->parse && !spec->parse(ctx, line, arguments)) {
+        return NULL;
+    }
+    return spec;
+}
+
+// Loads a command file, mapping it when it is a regular file; returns -1 if it cannot be opened
+static int load_input(const char *filename, CommandInput *input) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    *input = (CommandInput){NULL, 0, false};
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            input->data = map;
+            input->size = st.st_size;
+            input->mapped = true;
+            close(fd);
+            return 0;
+        }
+    }
+    // Not mappable (a pipe, or an empty file): read it whole, an unreadable one (a directory) counts as empty
+    size_t capacity = 0;
+    char *data = NULL;
+    for (;;) {
+        if (input->size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            char *grown = realloc(data, capacity);
+            if (!grown) {
+                break;
+            }
+            data = grown;
+        }
+        ssize_t n = read(fd, data + input->size, capacity - input->size);
+        if (n <= 0) {
+            break;
+        }
+        input->size += n;
+    }
+    input->data = data;
+    close(fd);
+    return 0;
+}
+
+static void unload_input(CommandInput *input) {
+    if (input->mapped) {
+        munmap((void *)input->data, input->size);
+    } else {
+        free((void *)input->data);
+    }
+}
+
+// Runs (or, when execute is false, only validates) every command of a file; returns the number of valid commands
+static long run_command_file(FsContext *ctx, const char *filename, const CommandInput *input, bool execute) {
+    CommandLine line;
+    Arguments arguments;
     int line_num = 0;
-    memset(buffer, 0, 1024); // Clear the buffer
-    // Process each line in the command file
-    while (fgets(line, sizeof(line), input)) {
+    long valid = 0;
+    size_t pos = 0;
+    while (pos < input->size) {
+        long long read_ns = stats_enabled ? monotonic_ns() : 0;
+        next_line(ctx, input, &pos, &line);
         line_num++; // Track line number for error reporting
-        line[strcspn(line, "\n")] = 0; // Remove trailing newline character
-        char command[10]; // Parse command
-        char arg1[10] = "", arg2[10] = ""; // Parse arguments
-        int args = sscanf(line, "%s %s %s", command, arg1, arg2);
-        if (args < 1) {
+        tokenize(&line);
+        if (line.tokens < 1) {
             continue; // Skip empty lines
         }
-        // Mount the file system found on disk
-        if (strcmp(command, "M") == 0) {
-            // M needs exactly 2 arguments
-            if (args != 2) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            fs_mount(arg1);
-        // Create a file
-        } else if (strcmp(command, "C") == 0) {
-            // C needs exactly 3 arguments
-            if (args != 3) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
+        bool timing = execute && (stats_enabled || command_observer);
+        long long started_ns = 0;
+        if (timing) {
+            started_ns = monotonic_ns();
+            if (stats_enabled) {
+                record_input_time(ctx, started_ns - read_ns);
             }
-            int size = atoi(arg2);
-            // Validate file size (0-127 blocks) and name length (max 5 characters)
-            if (size < 0 || size > 127 || strlen(arg1) > 5) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            char name[5] = {0};
-            strncpy(name, arg1, 5);
-            fs_create(name, size);
-        // Delete a file
-        } else if (strcmp(command, "D") == 0) {
-            // D needs exactly 2 arguments
-            if (args != 2) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            if (strlen(arg1) > 5) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            char name[5] = {0};
-            strncpy(name, arg1, 5);
-            fs_delete(name);
-        // Read from a file
-        } else if (strcmp(command, "R") == 0) {
-            // R needs exactly 3 arguments
-            if (args != 3) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            int block_num = atoi(arg2);
-            // Validate block number (0-126) and name length
-            if (block_num < 0 || block_num > 126 || strlen(arg1) > 5) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            char name[5] = {0};
-            strncpy(name, arg1, 5);
-            fs_read(name, block_num);
-        // Write to a file 
-        } else if (strcmp(command, "W") == 0) {
-            // W needs exactly 3 arguments
-            if (args != 3) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            int block_num = atoi(arg2);
-            // Validate block number (0-126) and name length
-            if (block_num < 0 || block_num > 126 || strlen(arg1) > 5) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            char name[5] = {0};
-            strncpy(name, arg1, 5);
-            fs_write(name, block_num);
-        // Update the buffer
-        } else if (strcmp(command, "B") == 0) {
-            char *first_space = strchr(line, ' '); // Special handling for buffer command as it can contain spaces
-            if (!first_space) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            char *content_start = first_space; // Find the buffer content after the command
-            while (*content_start == ' ') {
-                content_start++; // Skip additional spaces
-            }
-            // Check if there's actually content after skipping spaces
-            if (*content_start == '\0') {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            // Validate buffer content length (max 1024 bytes)
-            if (strlen(content_start) > 1024) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            uint8_t buffer_content[1024] = {0};
-            strncpy((char*)buffer_content, content_start, 1024); // Copy content to buffer
-            fs_buff(buffer_content);
-        // List files
-        } else if (strcmp(command, "L") == 0) {
-            char *rest_of_line = line + strlen(command); // Check if there are any additional characters after "L"
-            while (*rest_of_line == ' ') {
-                rest_of_line++; // Skip spaces
-            }
-            // If there's anything left after the command
-            if (*rest_of_line != '\0') {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
-            }
-            fs_ls();
-        // Defragment the disk
-        } else if (strcmp(command, "O") == 0) {
-            char *rest_of_line = line + strlen(command); // Check if there are any additional characters after "O"
-            while (*rest_of_line == ' ') {
-                rest_of_line++; // Skip spaces
-            }
-            // If there's anything left after the command
-            if (*rest_of_line != '\0') {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
+        }
+        const CommandSpec *spec = validate(ctx, &line, &arguments);
+        if (!spec) {
+            fprintf(ctx->err, "Command Error: %s, %d\n", filename, line_num);
+        } else {
+            valid++;
+            if (execute) {
+                ctx->path_directory = arguments.directory;
+                ctx->path_directory_length = arguments.directory_length;
+                ctx->command = line.token[0].text[0];
+                ctx->command_line = line_num;
+                spec->run(ctx, &arguments);
+                ctx->path_directory_length = 0;
+                ctx->command = 0;
+                ctx->command_line = 0;
             }
-            fs_defrag();
-        // Change the current working directory
-        } else if (strcmp(command, "Y") == 0) {
-            // Y needs exactly 2 arguments
-            if (args != 2) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
+        }
+        if (timing) {
+            long long elapsed_ns = monotonic_ns() - started_ns;
+            char command[8] = {0}; // Command name for the observers (truncated, only the first letter matters)
+            memcpy(command, line.token[0].text, line.token[0].length < 7 ? line.token[0].length : 7);
+            if (stats_enabled) {
+                record_command_latency(ctx, command, elapsed_ns);
             }
-            if (strlen(arg1) > 5) {
-                fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
-                continue;
+            if (command_observer) {
+                command_observer(command, elapsed_ns);
             }
-            char name[5] = {0};
-            strncpy(name, arg1, 5);
-            fs_cd(name);
-        // Unknown command
-        } else {
-            fprintf(stderr, "Command Error: %s, %d\n", filename, line_num);
         }
     }
-    fclose(input); // Cleanup
-    close_disk(); // Close the disk after processing all commands
-}
\ No newline at end of file
+    return valid;
+}
+
+// This function reads commands from a file and executes corresponding file system operations
+void process_command_file(FsContext *ctx, const char* filename) {
+    CommandInput input;
+    if (load_input(filename, &input) == -1) {
+        return; // Silently return if file can't be opened
+    }
+    memset(ctx->buffer, 0, fs_block_size(ctx)); // Clear the buffer
+    run_command_file(ctx, filename, &input, true);
+    unload_input(&input);
+    fs_finish(ctx); // End of the command file is a sync point, after which the disk is closed
+}
+
+// Parses and validates every command of a file without running any, reporting command errors as
+// process_command_file would; returns the number of valid commands, or -1 if the file cannot be opened
+long check_command_file(FsContext *ctx, const char *filename) {
+    CommandInput input;
+    if (load_input(filename, &input) == -1) {
+        return -1;
+    }
+    long valid = run_command_file(ctx, filename, &input, false);
+    unload_input(&input);
+    return valid;
+}
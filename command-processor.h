@@ -1,6 +1,13 @@
 #ifndef COMMAND_PROCESSOR_H
 #define COMMAND_PROCESSOR_H
+#include "fs-sim.h"
 
-void process_command_file(const char* filename);
+// Receives the command name and latency in nanoseconds of each command processed (used by benchmarks)
+typedef void (*CommandObserver)(const char *command, long long elapsed_ns);
+
+void process_command_file(FsContext *ctx, const char* filename);
+long check_command_file(FsContext *ctx, const char *filename);
+
+extern CommandObserver command_observer;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+# Crash-injection test for the metadata journal. Runs one workload (creates, writes, deletes, directory changes,
+# defrags and syncs) on a prefilled version 2 disk and counts its disk writes, then runs it again once per write with
+# FS_CRASH_AFTER_WRITES set, so the process dies halfway through that write. After every crash the disk must mount
+# without a consistency error, twice (replaying the journal must leave nothing to replay). The same crashes are injected
+# on a disk made without -j, whose failures are only reported. A second workload fills files with distinct blocks, frees
+# space between them and commits, then defragments; after a crash on each write of O every file must still read back
+# what was written to it.
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+CRASH_EXIT_STATUS = 99  # disk-ops.h
+GEOMETRY = '2,1024,2048,128'
+DEFRAG_GEOMETRY = '2,1024,256,64'
+
+
+def make_workload(seed, commands):
+    rng = random.Random(seed)
+    names = [f"n{i:03d}" for i in range(24)]
+    lines = ['M disk', 'B crash-test']
+    for i in range(commands):
+        kind = rng.choice('CCCCWWDDDYYS' + ('O' if i % 40 == 39 else ''))
+        name = rng.choice(names)
+        if kind == 'C':
+            lines.append(f"C {name} {rng.choice([0, 1, 2, 5, 9])}")
+        elif kind == 'W':
+            lines.append(f"W {name} 0")
+        elif kind == 'D':
+            lines.append(f"D {name}")
+        elif kind == 'Y':
+            lines.append(f"Y {rng.choice([name, '..'])}")
+        else:
+            lines.append(kind)
+    return '\n'.join(lines) + '\n'
+
+
+def make_defrag_workload(seed, data_blocks):
+    """Fills a disk of data_blocks blocks with files of distinct blocks, deletes every third file and makes an
+    extent-mapped file out of the gaps. Returns the commands up to a commit, and the same followed by O."""
+    rng = random.Random(seed)
+    sizes = []
+    while sum(sizes) < data_blocks:
+        sizes.append(min(rng.choice([1, 2, 3, 5, 9, 14]), data_blocks - sum(sizes)))
+    names = [f"f{i:02d}" for i in range(len(sizes))]
+    lines = ['M disk'] + [f"C {name} {size}" for name, size in zip(names, sizes)]
+    kept = [i for i in range(len(sizes)) if i % 3 != 1]
+    freed = [sizes[i] for i in range(len(sizes)) if i % 3 == 1]
+    lines += [f"D {names[i]}" for i in range(1, len(sizes), 3)]  # Gaps the files above slide into, over their own blocks
+    big = max(freed) + 1  # Larger than any gap, so it is extent-mapped
+    lines.append(f"C big {big}")
+    for i in kept:
+        for block in range(sizes[i]):
+            lines += [f"B {names[i]} {block} {'x' * rng.randrange(900)}", f"W {names[i]} {block}"]
+    for block in range(big):
+        lines += [f"B big {block}", f"W big {block}"]
+    setup = '\n'.join(lines + ['S']) + '\n'
+    return setup, setup + 'O\n'
+
+
+def file_contents(image):
+    """Contents of every file of a version 2 disk image, by name (names are unique in this workload)."""
+    data = image.read_bytes()
+    block_size, _, num_inodes, _, inode_start = struct.unpack_from('<5I', data, 12)
+    per_block = block_size // 20
+    files = {}
+    for i in range(num_inodes):
+        offset = (inode_start + i // per_block) * block_size + i % per_block * 20
+        name, flags, isused_size, start, isdir_parent = struct.unpack_from('<5sB2xIII', data, offset)
+        if not isused_size & 0x80000000 or isdir_parent & 0x80000000:
+            continue
+        if flags & 1:
+            count = struct.unpack_from('<I', data, start * block_size)[0]
+            runs = [struct.unpack_from('<II', data, start * block_size + 4 + 8 * k) for k in range(count)]
+            blocks = [b for run_start, run_count in runs for b in range(run_start, run_start + run_count)]
+        else:
+            blocks = range(start, start + (isused_size & 0x7FFFFFFF))
+        files[name.rstrip(b'\0').decode()] = b''.join(data[b * block_size:(b + 1) * block_size] for b in blocks)
+    return files
+
+
+def run_fs(fs, cwd, input_name, crash_after=0):
+    env = {'FS_IO_STATS': '1'}
+    if crash_after:
+        env['FS_CRASH_AFTER_WRITES'] = str(crash_after)
+    return subprocess.run([str(fs), input_name], cwd=cwd, capture_output=True, text=True, env=env)
+
+
+def mount_errors(fs, cwd):
+    result = run_fs(fs, cwd, 'mount')
+    return [line for line in result.stderr.splitlines() if line.startswith('Error')]
+
+
+def crash_points(fs, mkfs, cwd, journal):
+    image = cwd / 'image'
+    args = [str(mkfs), '-g', GEOMETRY, '-c', '40', '-f', '25', '-s', '7', str(image)]
+    if journal:
+        args.insert(1, '-j')
+    subprocess.run(args, check=True, capture_output=True)
+    shutil.copyfile(image, cwd / 'disk')
+    result = run_fs(fs, cwd, 'workload')
+    writes = int(re.search(r'(\d+) writes', result.stderr).group(1))
+    failures = []
+    for n in range(1, writes + 1):
+        shutil.copyfile(image, cwd / 'disk')
+        result = run_fs(fs, cwd, 'workload', crash_after=n)
+        if result.returncode != CRASH_EXIT_STATUS:
+            failures.append((n, f"exited with {result.returncode} instead of crashing"))
+            continue
+        errors = mount_errors(fs, cwd) + mount_errors(fs, cwd)
+        if errors:
+            failures.append((n, errors[0]))
+    return writes, failures
+
+
+def defrag_crash_points(fs, mkfs, cwd):
+    image = cwd / 'image'
+    subprocess.run([str(mkfs), '-j', '-g', DEFRAG_GEOMETRY, str(image)], check=True, capture_output=True)
+    num_blocks, _, _, _, data_start = struct.unpack_from('<5I', image.read_bytes(), 16)
+    setup, defrag = make_defrag_workload(23, num_blocks - data_start)
+    (cwd / 'defrag-setup').write_text(setup)
+    (cwd / 'defrag').write_text(defrag)
+    shutil.copyfile(image, cwd / 'disk')
+    result = run_fs(fs, cwd, 'defrag-setup')
+    setup_writes = int(re.search(r'(\d+) writes', result.stderr).group(1))
+    expected = file_contents(cwd / 'disk')
+    shutil.copyfile(image, cwd / 'disk')
+    result = run_fs(fs, cwd, 'defrag')
+    writes = int(re.search(r'(\d+) writes', result.stderr).group(1))
+    if file_contents(cwd / 'disk') != expected:
+        return 0, [(0, 'files changed by a defragmentation without a crash')]
+    failures = []
+    for n in range(setup_writes + 1, writes + 1):
+        shutil.copyfile(image, cwd / 'disk')
+        result = run_fs(fs, cwd, 'defrag', crash_after=n)
+        if result.returncode != CRASH_EXIT_STATUS:
+            failures.append((n, f"exited with {result.returncode} instead of crashing"))
+            continue
+        errors = mount_errors(fs, cwd) + mount_errors(fs, cwd)
+        if errors:
+            failures.append((n, errors[0]))
+            continue
+        contents = file_contents(cwd / 'disk')  # Safe to decode once mount found every file in range
+        changed = sorted(name for name in expected if contents.get(name) != expected[name])
+        if changed or contents.keys() != expected.keys():
+            failures.append((n, f"wrong contents in {', '.join(changed) or 'the file list'}"))
+    return writes - setup_writes, failures
+
+
+if __name__ == '__main__':
+    fs = Path('./fs').resolve()
+    mkfs = Path('./mkfs').resolve()
+    with tempfile.TemporaryDirectory() as tmpdir:
+        cwd = Path(tmpdir)
+        (cwd / 'workload').write_text(make_workload(19, 240))
+        (cwd / 'mount').write_text('M disk\n')
+        writes, failures = crash_points(fs, mkfs, cwd, journal=True)
+        for n, error in failures:
+            print(f"❌ crash on write {n}: {error}")
+        if not failures:
+            print(f"✅ journaled disk: consistent after a crash on each of {writes} writes")
+        plain_writes, plain_failures = crash_points(fs, mkfs, cwd, journal=False)
+        print(f"   disk without a journal: inconsistent after {len(plain_failures)} of {plain_writes} crashes")
+        defrag_writes, defrag_failures = defrag_crash_points(fs, mkfs, cwd)
+        for n, error in defrag_failures:
+            print(f"❌ crash on write {n}, during O: {error}")
+        if not defrag_failures:
+            print(f"✅ journaled disk: every file intact after a crash on each of the {defrag_writes} writes of O")
+    sys.exit(1 if failures or defrag_failures else 0)
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,87 +6,956 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include "fs-sim.h"
+#include <sys/mman.h>
+#include <errno.h>
+#include "checksum.h"
+#include "fs-context.h"
+#include "trace.h"
 #include <stdbool.h>
 
-// Open disk file for reading and writing
-int open_disk(const char *filename) {
-    disk_fd = open(filename, O_RDWR); // Open file with read/write access
-    return disk_fd; // Returns file descriptor
+AllocPolicy alloc_policy = ALLOC_FIRST_FIT; // Strategy used by find_contiguous_blocks
+DiskBackend disk_backend = BACKEND_FD; // Backend used for disks attached from now on
+bool punch_holes = false; // Zero blocks by punching holes in the disk file (FS_PUNCH_HOLES), until the host file system refuses
+long crash_after_writes = 0; // Simulate a crash on this write to each attached disk (FS_CRASH_AFTER_WRITES), 0 for never
+FILE *trace_file = NULL; // Every block I/O call is logged here when set (FS_TRACE)
+static long long trace_start_ns;
+
+// Starts logging every block I/O call of every context to a new trace file; returns -1 if it cannot be created
+int open_trace(const char *filename) {
+    trace_file = fopen(filename, "wb");
+    if (!trace_file) {
+        return -1;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+    trace_start_ns = monotonic_ns();
+    return 0;
+}
+
+// Writes out and closes the trace file
+void close_trace(void) {
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+// Appends a record of a call to the trace; one fwrite per record, so the records of threads do not interleave
+static void trace_io(const FsContext *ctx, uint8_t op, int block, int count) {
+    TraceRecord record = {monotonic_ns() - trace_start_ns, block, count, ctx->command_line, op, ctx->command, 0};
+    fwrite(&record, sizeof(record), 1, trace_file);
+}
+
+// Reads count consecutive blocks straight from the disk, bypassing the cache. pread leaves the shared file offset
+// alone, so threads reading different blocks of one disk do not need to hold a lock around the call.
+static void disk_read(FsContext *ctx, int block_num, int count, uint8_t *data) {
+    Disk *disk = &ctx->volume->disk;
+    off_t offset = (off_t)block_num * disk->block_size; // Calculate byte offset: block number * bytes per block
+    long long started_ns = stats_enabled ? monotonic_ns() : 0;
+    ssize_t n = pread(disk->fd, data, (size_t)count * disk->block_size, offset); // Read the whole run
+    if (stats_enabled) {
+        ctx->io_stats.io_ns += monotonic_ns() - started_ns;
+    }
+    ctx->io_stats.reads++;
+    if (n > 0) {
+        ctx->io_stats.bytes_read += n;
+    }
+}
+
+// Writes count consecutive blocks straight to the disk, bypassing the cache
+static void disk_write(FsContext *ctx, int block_num, int count, const uint8_t *data) {
+    Disk *disk = &ctx->volume->disk;
+    off_t offset = (off_t)block_num * disk->block_size; // Calculate byte offset: block number * bytes per block
+    if (disk->writes_until_crash > 0 && --disk->writes_until_crash == 0) {
+        // Simulated crash: only the first half of this write reaches the disk, then the process dies
+        if (trace_file) {
+            fflush(trace_file); // Keep the calls up to the crash
+        }
+        ssize_t torn = pwrite(disk->fd, data, (size_t)count * disk->block_size / 2, offset);
+        _exit(torn >= 0 ? CRASH_EXIT_STATUS : CRASH_EXIT_STATUS + 1);
+    }
+    long long started_ns = stats_enabled ? monotonic_ns() : 0;
+    ssize_t n = pwrite(disk->fd, data, (size_t)count * disk->block_size, offset); // Write the whole run
+    if (stats_enabled) {
+        ctx->io_stats.io_ns += monotonic_ns() - started_ns;
+    }
+    ctx->io_stats.writes++;
+    if (n > 0) {
+        ctx->io_stats.bytes_written += n;
+    }
+}
+
+// Sets the checksums of blocks [start, start + count) to those of their new contents in data, or clears them when data
+// is NULL (the blocks were zeroed). Only data blocks have checksums, on a disk with a checksum table.
+static void record_checksums(FsContext *ctx, int start, int count, const uint8_t *data) {
+    Superblock *sb = &ctx->volume->superblock;
+    int first = start > (int)sb->data_start ? start : (int)sb->data_start;
+    if (!sb->block_checksums || first >= start + count) {
+        return;
+    }
+    for (int block = first; block < start + count; block++) {
+        sb->block_checksums[block] = data ? crc32c(0, data + (size_t)(block - start) * sb->block_size, sb->block_size) : 0;
+    }
+    pthread_mutex_lock(&ctx->volume->cache_lock);
+    for (int block = first; block < start + count; block++) {
+        mark_checksum_dirty(ctx, block);
+    }
+    pthread_mutex_unlock(&ctx->volume->cache_lock);
+}
+
+// Checks blocks [start, start + count), just read from the disk into data, against their checksums; the first one that
+// does not match is left in ctx->corrupt_block unless an earlier one is there
+static void verify_checksums(FsContext *ctx, int start, int count, const uint8_t *data) {
+    const Superblock *sb = &ctx->volume->superblock;
+    if (!sb->block_checksums) {
+        return;
+    }
+    for (int block = start > (int)sb->data_start ? start : (int)sb->data_start; block < start + count; block++) {
+        uint32_t expected = sb->block_checksums[block];
+        if (expected != 0 && crc32c(0, data + (size_t)(block - start) * sb->block_size, sb->block_size) != expected) {
+            if (ctx->corrupt_block == -1) {
+                ctx->corrupt_block = block;
+            }
+        }
+    }
+}
+
+// Copies the checksums of blocks [start, start + count) to checksums (zeros if the disk has no table), so a move can
+// store them at its destination after the write that recomputes them there
+void load_block_checksums(const FsContext *ctx, int start, int count, uint32_t *checksums) {
+    const Superblock *sb = &ctx->volume->superblock;
+    if (!sb->block_checksums) {
+        memset(checksums, 0, (size_t)count * sizeof(uint32_t));
+        return;
+    }
+    memcpy(checksums, &sb->block_checksums[start], (size_t)count * sizeof(uint32_t));
+}
+
+// Gives blocks [start, start + count) the checksums loaded from the blocks their data was copied from, so a block that
+// was corrupt before a move still fails its check afterwards
+void store_block_checksums(FsContext *ctx, int start, int count, const uint32_t *checksums) {
+    Superblock *sb = &ctx->volume->superblock;
+    if (!sb->block_checksums) {
+        return;
+    }
+    memcpy(&sb->block_checksums[start], checksums, (size_t)count * sizeof(uint32_t));
+    pthread_mutex_lock(&ctx->volume->cache_lock);
+    for (int block = start; block < start + count; block++) {
+        mark_checksum_dirty(ctx, block);
+    }
+    pthread_mutex_unlock(&ctx->volume->cache_lock);
+}
+
+// The zero map has one bit per block, set while the block is known to read back as zeros. Only data blocks are tracked,
+// and only while a disk is mounted. W commands on files whose blocks share a word can run at the same time, so bits
+// change atomically.
+static bool known_zero(const Disk *disk, int block) {
+    return disk->zero_map && (__atomic_load_n(&disk->zero_map[block / 64], __ATOMIC_RELAXED) >> (block % 64) & 1);
+}
+
+static void set_known_zero(FsContext *ctx, int block, bool zero) {
+    Disk *disk = &ctx->volume->disk;
+    if (!disk->zero_map || block < (int)ctx->volume->superblock.data_start) {
+        return;
+    }
+    uint64_t bit = 1ULL << (block % 64);
+    if (zero) {
+        __atomic_fetch_or(&disk->zero_map[block / 64], bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&disk->zero_map[block / 64], ~bit, __ATOMIC_RELAXED);
+    }
+}
+
+// Returns true if all size bytes of data are zero. Comparing the bytes with their neighbours runs on the C library's
+// vectorized memcmp.
+static bool is_zero(const uint8_t *data, size_t size) {
+    return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+// Records which of blocks [start, start + count), whose contents are in data, are zero blocks
+static void note_zero_blocks(FsContext *ctx, int start, int count, const uint8_t *data) {
+    Disk *disk = &ctx->volume->disk;
+    if (!disk->zero_map) {
+        return;
+    }
+    for (int block = start > (int)ctx->volume->superblock.data_start ? start : (int)ctx->volume->superblock.data_start;
+         block < start + count; block++) {
+        set_known_zero(ctx, block, is_zero(data + (size_t)(block - start) * disk->block_size, disk->block_size));
+    }
+}
+
+// Returns true if a read of block can just clear the buffer: it is known to be zero and has no checksum to check
+static bool zero_read(const FsContext *ctx, int block) {
+    const uint32_t *checksums = ctx->volume->superblock.block_checksums;
+    return known_zero(&ctx->volume->disk, block) && (!checksums || checksums[block] == 0);
+}
+
+// Marks the data blocks of the disk that lie in holes of the disk file as known zero blocks (mkfs leaves the whole data
+// area a hole, and punched blocks stay holes); other blocks are learned as they are read and written
+void rebuild_zero_map(FsContext *ctx) {
+    Disk *disk = &ctx->volume->disk;
+    free(disk->zero_map);
+    disk->zero_map = calloc((disk->num_blocks + 63) / 64, sizeof(uint64_t));
+    if (!disk->zero_map || disk->fd == -1) {
+        return; // Without a map every block is read and written as before
+    }
+    off_t block_size = disk->block_size;
+    off_t end = (off_t)disk->num_blocks * block_size;
+    off_t offset = (off_t)ctx->volume->superblock.data_start * block_size;
+    while (offset < end) {
+        off_t hole = lseek(disk->fd, offset, SEEK_HOLE);
+        if (hole == -1 || hole >= end) {
+            break;
+        }
+        off_t data = lseek(disk->fd, hole, SEEK_DATA);
+        if (data == -1 || data > end) {
+            data = end; // The hole runs to the end of the file
+        }
+        for (off_t block = (hole + block_size - 1) / block_size; block < data / block_size; block++) {
+            set_known_zero(ctx, block, true); // Only blocks the hole covers completely
+        }
+        offset = data;
+    }
+}
+
+// Number of blocks known to be zero (0 when no disk is mounted)
+int count_zero_blocks(FsContext *ctx) {
+    const Disk *disk = &ctx->volume->disk;
+    int count = 0;
+    for (int word = 0; disk->zero_map && word < (disk->num_blocks + 63) / 64; word++) {
+        count += __builtin_popcountll(__atomic_load_n(&disk->zero_map[word], __ATOMIC_RELAXED));
+    }
+    return count;
+}
+
+// Writes a dirty slot back to disk
+static void write_back(FsContext *ctx, CacheSlot *slot) {
+    if (slot->valid && slot->dirty) {
+        disk_write(ctx, slot->block_num, 1, slot->data);
+        slot->dirty = false;
+        ctx->cache_stats.flushes++;
+    }
+}
+
+// Drops every cached block without writing anything back
+static void invalidate_cache(Disk *disk) {
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        disk->cache[i].valid = false;
+        disk->cache[i].dirty = false;
+        disk->cache[i].referenced = false;
+    }
+    if (disk->cache_slot_of) {
+        memset(disk->cache_slot_of, 0, disk->num_blocks * sizeof(int));
+    }
+    disk->clock_hand = 0;
+}
+
+// Returns the slot caching block_num, claiming one (CLOCK eviction, write-back if dirty) on a miss
+static CacheSlot *cache_slot(FsContext *ctx, int block_num, bool *hit) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->cache_slot_of[block_num] != 0) {
+        CacheSlot *slot = &disk->cache[disk->cache_slot_of[block_num] - 1];
+        slot->referenced = true;
+        ctx->cache_stats.hits++;
+        *hit = true;
+        return slot;
+    }
+    ctx->cache_stats.misses++;
+    *hit = false;
+    // Sweep the clock hand until a slot that is empty or has not been referenced since the last sweep
+    while (disk->cache[disk->clock_hand].valid && disk->cache[disk->clock_hand].referenced) {
+        disk->cache[disk->clock_hand].referenced = false;
+        disk->clock_hand = (disk->clock_hand + 1) % CACHE_SIZE;
+    }
+    CacheSlot *slot = &disk->cache[disk->clock_hand];
+    if (slot->valid) {
+        write_back(ctx, slot); // Evict: persist the old block if it was modified
+        disk->cache_slot_of[slot->block_num] = 0;
+    }
+    slot->block_num = block_num;
+    slot->valid = true;
+    slot->dirty = false;
+    slot->referenced = true;
+    disk->cache_slot_of[block_num] = disk->clock_hand + 1;
+    disk->clock_hand = (disk->clock_hand + 1) % CACHE_SIZE;
+    return slot;
+}
+
+// Open disk file for reading and writing, with the geometry of a version 1 disk
+int open_disk(FsContext *ctx, const char *filename) {
+    int fd = open(filename, O_RDWR); // Open file with read/write access
+    if (fd != -1) {
+        attach_disk(ctx, fd, V1_BLOCK_SIZE, V1_NUM_BLOCKS);
+    }
+    return ctx->volume->disk.fd; // Returns file descriptor
+}
+
+// Selects the backend ("fd" or "mmap") used for disks attached from now on; returns -1 for an unknown name
+int set_disk_backend(const char *name) {
+    if (strcmp(name, "fd") == 0) {
+        disk_backend = BACKEND_FD;
+    } else if (strcmp(name, "mmap") == 0) {
+        disk_backend = BACKEND_MMAP;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Makes an already opened disk file with the given geometry the current disk, starting with an empty cache
+void attach_disk(FsContext *ctx, int fd, int block_size, int num_blocks) {
+    Disk *disk = &ctx->volume->disk;
+    close_disk(ctx);
+    // Resize the cache for the new geometry; the slot table is indexed by block number
+    int *slot_of = realloc(disk->cache_slot_of, num_blocks * sizeof(int));
+    uint8_t *pool = block_size == disk->block_size && disk->cache_pool ? disk->cache_pool
+                                                                      : realloc(disk->cache_pool, (size_t)CACHE_SIZE * block_size);
+    if (!slot_of || !pool) {
+        fprintf(ctx->err, "Error: Out of memory caching the disk\n");
+        exit(1);
+    }
+    disk->cache_slot_of = slot_of;
+    disk->cache_pool = pool;
+    disk->block_size = block_size;
+    disk->num_blocks = num_blocks;
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        disk->cache[i].data = disk->cache_pool + (size_t)i * block_size;
+    }
+    disk->fd = fd;
+    disk->punch_holes = punch_holes;
+    disk->writes_until_crash = crash_after_writes;
+    invalidate_cache(disk);
+    if (trace_file) {
+        trace_io(ctx, TRACE_ATTACH, block_size, num_blocks);
+    }
+    if (disk_backend == BACKEND_MMAP) {
+        struct stat st;
+        // Map the whole disk file; fall back to the fd backend if it cannot be mapped
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                disk->map = map;
+                disk->map_size = st.st_size;
+            }
+        }
+    }
 }
 
 // Close the disk file
-void close_disk(void) {
-    if (disk_fd != -1) {
-        close(disk_fd);
-        disk_fd = -1; // Reset to invalid descriptor
+void close_disk(FsContext *ctx) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->fd != -1) {
+        zero_deferred_blocks(ctx);
+        flush_cache(ctx); // Persist all dirty blocks before the descriptor goes away
+        invalidate_cache(disk);
+        if (disk->map) {
+            munmap(disk->map, disk->map_size);
+            disk->map = NULL;
+            disk->map_size = 0;
+        }
+        close(disk->fd);
+        disk->fd = -1; // Reset to invalid descriptor
+        free(disk->zero_map);
+        disk->zero_map = NULL;
     }
 }
 
-// Reads a 1024-byte block from the disk into memory
-void read_block(int block_num, uint8_t *data) {
-    if (disk_fd == -1) {
-        return; // No disk open, silent failure
+// Closes the disk and releases the cache and free space summary of a context
+void free_disk(FsContext *ctx) {
+    Disk *disk = &ctx->volume->disk;
+    close_disk(ctx);
+    free(disk->cache_pool);
+    free(disk->cache_slot_of);
+    free(disk->deferred_zero);
+    free(disk->free_extents.runs);
+    disk->cache_pool = NULL;
+    disk->cache_slot_of = NULL;
+    disk->deferred_zero = NULL;
+    disk->deferred_count = 0;
+    disk->deferred_capacity = 0;
+    disk->free_extents = (FreeExtents){0};
+}
+
+// Returns a direct pointer to a block of a memory-mapped disk, or NULL when the block is not mapped
+uint8_t *block_pointer(FsContext *ctx, int block_num) {
+    Disk *disk = &ctx->volume->disk;
+    if (!disk->map || block_num < 0 || (size_t)(block_num + 1) * disk->block_size > disk->map_size) {
+        return NULL;
+    }
+    return disk->map + (size_t)block_num * disk->block_size;
+}
+
+// Orders cache slots by the block they hold
+static int compare_slots_by_block(const void *a, const void *b) {
+    const CacheSlot *slot_a = *(CacheSlot * const *)a;
+    const CacheSlot *slot_b = *(CacheSlot * const *)b;
+    return slot_a->block_num - slot_b->block_num;
+}
+
+// Writes every dirty cached block back to disk, in block order (msync for a mapped disk)
+void flush_cache(FsContext *ctx) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->fd == -1) {
+        return;
     }
-    off_t offset = block_num * 1024; // Calculate byte offset: block number * 1024 bytes per block
-    // Move file pointer to the beginning of the specified block
-    if (lseek(disk_fd, offset, SEEK_SET) == -1) {
+    if (trace_file) {
+        trace_io(ctx, TRACE_FLUSH, 0, 0);
+    }
+    if (disk->map) {
+        msync(disk->map, disk->map_size, MS_SYNC);
+        return;
+    }
+    // Collect the dirty slots and write them back in block order
+    CacheSlot *dirty[CACHE_SIZE];
+    int count = 0;
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (disk->cache[i].valid && disk->cache[i].dirty) {
+            dirty[count++] = &disk->cache[i];
+        }
+    }
+    qsort(dirty, count, sizeof(CacheSlot *), compare_slots_by_block);
+    for (int i = 0; i < count; i++) {
+        write_back(ctx, dirty[i]);
+    }
+}
+
+// Waits until everything written to the disk file is stored, so later writes cannot reach the disk before it
+void sync_disk(FsContext *ctx) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->fd == -1) {
         return;
     }
-    read(disk_fd, data, 1024); // Read exactly 1024 bytes (one block) from current file position
+    if (trace_file) {
+        trace_io(ctx, TRACE_SYNC, 0, 0);
+    }
+    if (disk->map) {
+        msync(disk->map, disk->map_size, MS_SYNC);
+    }
+    fdatasync(disk->fd);
 }
 
-// Writes a 1024-byte block from memory to disk
-void write_block(int block_num, uint8_t *data) {
-    if (disk_fd == -1) {
-        return; // No disk open, silent failure
+// Fills count consecutive blocks with zeros: cached copies become clean zero blocks, so reads of the range keep hitting
+// the cache, and the disk gets disk writes of up to ZERO_CHUNK_BYTES each (a single one from zeros when the caller has
+// count zero blocks at hand), or a hole punched in the disk file when punch_holes is set and the host file system
+// supports it (the blocks still read back as zeros)
+static void clear_blocks(FsContext *ctx, int start, int count, const uint8_t *zeros) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->map) {
+        uint8_t *first = block_pointer(ctx, start);
+        if (first && block_pointer(ctx, start + count - 1)) {
+            memset(first, 0, (size_t)count * disk->block_size);
+        }
+        return;
     }
-    off_t offset = block_num * 1024; // Calculate byte offset: block number * 1024 bytes per block
-    // Move file pointer to the beginning of the specified block
-    if (lseek(disk_fd, offset, SEEK_SET) == -1) {
-        return; // Seek failed, silent failure
+    pthread_mutex_lock(&ctx->volume->cache_lock);
+    for (int block = start; block < start + count; block++) {
+        if (disk->cache_slot_of[block] != 0) {
+            CacheSlot *slot = &disk->cache[disk->cache_slot_of[block] - 1];
+            memset(slot->data, 0, disk->block_size);
+            slot->dirty = false;
+        }
     }
-    write(disk_fd, data, 1024); // Write exactly 1024 bytes (one block) from current file position
+    pthread_mutex_unlock(&ctx->volume->cache_lock);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (disk->punch_holes) {
+        if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start * disk->block_size,
+                      (off_t)count * disk->block_size) == 0) {
+            ctx->io_stats.punches++;
+            return;
+        }
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            disk->punch_holes = false; // Not on this file system, write zeros from now on
+        }
+    }
+#endif
+    if (zeros) {
+        disk_write(ctx, start, count, zeros);
+        return;
+    }
+    int chunk_blocks = ZERO_CHUNK_BYTES / disk->block_size > 0 ? ZERO_CHUNK_BYTES / disk->block_size : 1;
+    int chunk = count < chunk_blocks ? count : chunk_blocks;
+    uint8_t *chunk_zeros = calloc(chunk, disk->block_size);
+    if (!chunk_zeros) {
+        return;
+    }
+    for (int block = start; block < start + count; block += chunk) {
+        disk_write(ctx, block, start + count - block < chunk ? start + count - block : chunk, chunk_zeros);
+    }
+    free(chunk_zeros);
+}
+
+// Reads one block from the disk into memory
+void read_block(FsContext *ctx, int block_num, uint8_t *data) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->fd == -1 || block_num < 0 || block_num >= disk->num_blocks) {
+        return; // No disk open or block out of range, silent failure
+    }
+    ctx->io_stats.block_reads++;
+    if (trace_file) {
+        trace_io(ctx, TRACE_READ, block_num, 1);
+    }
+    if (zero_read(ctx, block_num)) {
+        memset(data, 0, disk->block_size);
+        ctx->io_stats.zero_reads++;
+        return;
+    }
+    if (disk->map) {
+        uint8_t *block = block_pointer(ctx, block_num);
+        if (block) {
+            memcpy(data, block, disk->block_size); // Single copy out of the page cache, no system call
+            verify_checksums(ctx, block_num, 1, data);
+        }
+        return;
+    }
+    bool hit;
+    pthread_mutex_lock(&ctx->volume->cache_lock);
+    CacheSlot *slot = cache_slot(ctx, block_num, &hit);
+    if (!hit) {
+        disk_read(ctx, block_num, 1, slot->data); // Miss: fill the slot from disk
+        verify_checksums(ctx, block_num, 1, slot->data); // A hit holds what was checked or written before
+        note_zero_blocks(ctx, block_num, 1, slot->data);
+    }
+    memcpy(data, slot->data, disk->block_size);
+    pthread_mutex_unlock(&ctx->volume->cache_lock);
+}
+
+// Writes one block from memory to disk (deferred until eviction or flush)
+void write_block(FsContext *ctx, int block_num, uint8_t *data) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->fd == -1 || block_num < 0 || block_num >= disk->num_blocks) {
+        return; // No disk open or block out of range, silent failure
+    }
+    ctx->io_stats.block_writes++;
+    if (trace_file) {
+        trace_io(ctx, TRACE_WRITE, block_num, 1);
+    }
+    record_checksums(ctx, block_num, 1, data);
+    bool zero = disk->zero_map && block_num >= (int)ctx->volume->superblock.data_start && is_zero(data, disk->block_size);
+    if (zero && known_zero(disk, block_num)) {
+        ctx->io_stats.zero_writes++; // Already zero on disk or in the cache
+        return;
+    }
+    if (zero && disk->punch_holes && !disk->map) {
+        clear_blocks(ctx, block_num, 1, data); // A hole instead of a block of zeros
+        set_known_zero(ctx, block_num, true);
+        return;
+    }
+    if (disk->map) {
+        uint8_t *block = block_pointer(ctx, block_num);
+        if (block) {
+            memcpy(block, data, disk->block_size); // Stores land in the shared mapping, written out by the kernel or msync
+        }
+    } else {
+        bool hit;
+        pthread_mutex_lock(&ctx->volume->cache_lock);
+        CacheSlot *slot = cache_slot(ctx, block_num, &hit); // Whole block is overwritten, so a miss needs no read
+        memcpy(slot->data, data, disk->block_size);
+        slot->dirty = true;
+        pthread_mutex_unlock(&ctx->volume->cache_lock);
+    }
+    set_known_zero(ctx, block_num, zero);
+}
+
+// Returns true if blocks [start, start + count) lie inside the disk
+static bool valid_range(const Disk *disk, int start, int count) {
+    return disk->fd != -1 && start >= 0 && count > 0 && start + count <= disk->num_blocks;
+}
+
+// Drops cached copies of blocks [start, start + count) without writing them back
+static void drop_cached_blocks(Disk *disk, int start, int count) {
+    for (int block = start; block < start + count; block++) {
+        if (disk->cache_slot_of[block] != 0) {
+            CacheSlot *slot = &disk->cache[disk->cache_slot_of[block] - 1];
+            slot->valid = false;
+            slot->dirty = false;
+            disk->cache_slot_of[block] = 0;
+        }
+    }
+}
+
+// Reads count consecutive blocks into data with a single disk read. Known zero blocks at either end of the range are
+// cleared in data instead of being read.
+void read_blocks(FsContext *ctx, int start, int count, uint8_t *data) {
+    Disk *disk = &ctx->volume->disk;
+    if (!valid_range(disk, start, count)) {
+        return; // No disk open or range out of bounds, silent failure
+    }
+    ctx->io_stats.block_reads += count;
+    if (trace_file) {
+        trace_io(ctx, TRACE_READ_RUN, start, count);
+    }
+    int first = start;
+    int end = start + count;
+    while (first < end && zero_read(ctx, first)) {
+        first++;
+    }
+    while (end > first && zero_read(ctx, end - 1)) {
+        end--;
+    }
+    memset(data, 0, (size_t)(first - start) * disk->block_size);
+    memset(data + (size_t)(end - start) * disk->block_size, 0, (size_t)(start + count - end) * disk->block_size);
+    ctx->io_stats.zero_reads += count - (end - first);
+    if (first == end) {
+        return;
+    }
+    data += (size_t)(first - start) * disk->block_size;
+    if (disk->map) {
+        uint8_t *mapped = block_pointer(ctx, first);
+        if (mapped && block_pointer(ctx, end - 1)) {
+            memcpy(data, mapped, (size_t)(end - first) * disk->block_size);
+            verify_checksums(ctx, first, end - first, data);
+        }
+        return;
+    }
+    // Write back cached changes in the range so the disk holds the newest data. The read itself runs without the cache
+    // lock: the caller's data lock keeps writers of these blocks out until it returns.
+    pthread_mutex_lock(&ctx->volume->cache_lock);
+    for (int block = first; block < end; block++) {
+        if (disk->cache_slot_of[block] != 0) {
+            write_back(ctx, &disk->cache[disk->cache_slot_of[block] - 1]);
+        }
+    }
+    pthread_mutex_unlock(&ctx->volume->cache_lock);
+    disk_read(ctx, first, end - first, data);
+    verify_checksums(ctx, first, end - first, data);
+    note_zero_blocks(ctx, first, end - first, data);
+}
+
+// Zeroes the blocks of [start, start + count) that are not known to be zero yet with clear_blocks (zeros holds count
+// zero blocks or is NULL) and marks them known zero
+static void zero_unknown_blocks(FsContext *ctx, int start, int count, const uint8_t *zeros) {
+    Disk *disk = &ctx->volume->disk;
+    int block = start;
+    while (block < start + count) {
+        if (known_zero(disk, block)) {
+            ctx->io_stats.zero_writes++;
+            block++;
+            continue;
+        }
+        int run_start = block;
+        while (block < start + count && !known_zero(disk, block)) {
+            block++;
+        }
+        clear_blocks(ctx, run_start, block - run_start, zeros ? zeros + (size_t)(run_start - start) * disk->block_size : NULL);
+        for (int cleared = run_start; cleared < block; cleared++) {
+            set_known_zero(ctx, cleared, true);
+        }
+    }
+}
+
+// Writes count consecutive blocks from data with a single disk write. A run of zero blocks skips the blocks known to be
+// zero already and zeroes the rest like zero_blocks.
+void write_blocks(FsContext *ctx, int start, int count, const uint8_t *data) {
+    Disk *disk = &ctx->volume->disk;
+    if (!valid_range(disk, start, count)) {
+        return; // No disk open or range out of bounds, silent failure
+    }
+    ctx->io_stats.block_writes += count;
+    if (trace_file) {
+        trace_io(ctx, TRACE_WRITE_RUN, start, count);
+    }
+    record_checksums(ctx, start, count, data);
+    if (disk->zero_map && start >= (int)ctx->volume->superblock.data_start && is_zero(data, (size_t)count * disk->block_size)) {
+        zero_unknown_blocks(ctx, start, count, data);
+        return;
+    }
+    if (disk->map) {
+        uint8_t *first = block_pointer(ctx, start);
+        if (first && block_pointer(ctx, start + count - 1)) {
+            memcpy(first, data, (size_t)count * disk->block_size);
+        }
+    } else {
+        pthread_mutex_lock(&ctx->volume->cache_lock);
+        drop_cached_blocks(disk, start, count); // Cached copies in the range are superseded
+        pthread_mutex_unlock(&ctx->volume->cache_lock);
+        disk_write(ctx, start, count, data);
+    }
+    note_zero_blocks(ctx, start, count, data);
+}
+
+// Fills count consecutive blocks with zeros (see clear_blocks); blocks known to be zero already are left alone
+void zero_blocks(FsContext *ctx, int start, int count) {
+    Disk *disk = &ctx->volume->disk;
+    if (!valid_range(disk, start, count)) {
+        return;
+    }
+    if (trace_file) {
+        trace_io(ctx, TRACE_ZERO, start, count);
+    }
+    record_checksums(ctx, start, count, NULL);
+    ctx->io_stats.block_writes += count; // Counted like write_blocks on both backends, skipped blocks included
+    zero_unknown_blocks(ctx, start, count, NULL);
+}
+
+// Queues freed blocks [start, start + count) to be zeroed by the next zero_deferred_blocks
+void defer_zero_blocks(FsContext *ctx, int start, int count) {
+    Disk *disk = &ctx->volume->disk;
+    if (disk->deferred_count == disk->deferred_capacity) {
+        int capacity = disk->deferred_capacity ? disk->deferred_capacity * 2 : 64;
+        Extent *runs = realloc(disk->deferred_zero, capacity * sizeof(Extent));
+        if (!runs) {
+            zero_blocks(ctx, start, count); // Out of memory: zero the run right away
+            return;
+        }
+        disk->deferred_zero = runs;
+        disk->deferred_capacity = capacity;
+    }
+    disk->deferred_zero[disk->deferred_count++] = (Extent){start, count};
+}
+
+// Orders runs by their first block
+static int compare_extents(const void *a, const void *b) {
+    return ((const Extent *)a)->start - ((const Extent *)b)->start;
+}
+
+// Zeroes every queued run, merging runs that touch so each contiguous range takes one write or hole punch
+void zero_deferred_blocks(FsContext *ctx) {
+    Disk *disk = &ctx->volume->disk;
+    Extent *runs = disk->deferred_zero;
+    if (disk->deferred_count == 0) {
+        return; // Nothing queued, and the queue may not be allocated yet
+    }
+    qsort(runs, disk->deferred_count, sizeof(Extent), compare_extents);
+    int i = 0;
+    while (i < disk->deferred_count) {
+        int start = runs[i].start;
+        int end = start + runs[i].size;
+        for (i++; i < disk->deferred_count && runs[i].start <= end; i++) {
+            if (runs[i].start + runs[i].size > end) {
+                end = runs[i].start + runs[i].size;
+            }
+        }
+        if (end - start == 1 && !disk->map) {
+            // A lone block costs one write either way; through the cache, a new file's write to it can still absorb it
+            uint8_t *zeros = calloc(1, disk->block_size);
+            if (zeros) {
+                write_block(ctx, start, zeros);
+                record_checksums(ctx, start, 1, NULL); // A freed block is unchecked, however it was zeroed
+            }
+            free(zeros);
+        } else {
+            zero_blocks(ctx, start, end - start);
+        }
+    }
+    disk->deferred_count = 0;
+}
+
+// Loads 64 blocks of the bitmap as one word, block (word * 64) in the most significant bit
+static uint64_t bitmap_word(const Superblock *sb, int word) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | sb->free_block_list[word * 8 + i];
+    }
+    return value;
+}
+
+// Returns the first block at or after from whose bitmap bit equals allocated, or num_blocks if there is none
+static int next_block_with_state(const Superblock *sb, int from, bool allocated) {
+    int num_blocks = sb->num_blocks;
+    int words = (num_blocks + 63) / 64; // The in-memory bitmap is padded to whole words
+    for (int word = from / 64; word < words; word++) {
+        uint64_t bits = bitmap_word(sb, word);
+        if (!allocated) {
+            bits = ~bits; // Search for zero bits by inverting the word
+        }
+        if (word == from / 64) {
+            bits &= ~0ULL >> (from % 64); // Ignore blocks before from
+        }
+        if (bits != 0) {
+            int block = word * 64 + __builtin_clzll(bits); // Jump straight over the run of opposite bits
+            return block < num_blocks ? block : num_blocks; // Padding bits past the end do not count
+        }
+    }
+    return num_blocks;
+}
+
+// Grows the run array so it can hold at least needed runs
+static void reserve_free_extents(FsContext *ctx, int needed) {
+    FreeExtents *free_extents = &ctx->volume->disk.free_extents;
+    if (needed <= free_extents->capacity) {
+        return;
+    }
+    int capacity = free_extents->capacity ? free_extents->capacity : 64;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    Extent *runs = realloc(free_extents->runs, capacity * sizeof(Extent));
+    if (!runs) {
+        fprintf(ctx->err, "Error: Out of memory tracking free blocks\n");
+        exit(1);
+    }
+    free_extents->runs = runs;
+    free_extents->capacity = capacity;
+}
+
+// Rebuilds the free extent summary from the bitmap (data blocks only)
+void rebuild_free_extents(FsContext *ctx) {
+    const Superblock *sb = &ctx->volume->superblock;
+    FreeExtents *free_extents = &ctx->volume->disk.free_extents;
+    free_extents->count = 0;
+    free_extents->largest = 0;
+    int block = sb->data_start;
+    while (block < (int)sb->num_blocks) {
+        int start = next_block_with_state(sb, block, false);
+        if (start >= (int)sb->num_blocks) {
+            break;
+        }
+        int end = next_block_with_state(sb, start, true);
+        reserve_free_extents(ctx, free_extents->count + 1);
+        free_extents->runs[free_extents->count].start = start;
+        free_extents->runs[free_extents->count].size = end - start;
+        free_extents->count++;
+        if (end - start > free_extents->largest) {
+            free_extents->largest = end - start;
+        }
+        block = end;
+    }
+}
+
+// Replaces runs[first..last] of the summary with the given replacement runs
+static void splice_free_extents(FsContext *ctx, int first, int last, Extent *replacement, int replacement_count) {
+    FreeExtents *free_extents = &ctx->volume->disk.free_extents;
+    int removed = last - first + 1;
+    reserve_free_extents(ctx, free_extents->count + replacement_count - removed);
+    int tail = free_extents->count - (last + 1);
+    memmove(&free_extents->runs[first + replacement_count], &free_extents->runs[last + 1], tail * sizeof(Extent));
+    memcpy(&free_extents->runs[first], replacement, replacement_count * sizeof(Extent));
+    free_extents->count += replacement_count - removed;
+    free_extents->largest = 0;
+    for (int i = 0; i < free_extents->count; i++) {
+        if (free_extents->runs[i].size > free_extents->largest) {
+            free_extents->largest = free_extents->runs[i].size;
+        }
+    }
+}
+
+// Applies an allocation or release of blocks [start, end) to the free extent summary
+static void update_free_extents(FsContext *ctx, int start, int end, bool allocated) {
+    FreeExtents *free_extents = &ctx->volume->disk.free_extents;
+    if (start < (int)ctx->volume->superblock.data_start) {
+        start = ctx->volume->superblock.data_start; // Metadata blocks are never part of a free run
+    }
+    if (end > (int)ctx->volume->superblock.num_blocks) {
+        end = ctx->volume->superblock.num_blocks;
+    }
+    if (start >= end) {
+        return;
+    }
+    // Find the runs that overlap the range (or touch it, when freeing, so they can be merged)
+    int first = 0;
+    int past = free_extents->count;
+    while (first < past) {
+        // Binary search for the first run that does not end before the range
+        int middle = (first + past) / 2;
+        if (free_extents->runs[middle].start + free_extents->runs[middle].size < start + (allocated ? 1 : 0)) {
+            first = middle + 1;
+        } else {
+            past = middle;
+        }
+    }
+    int last = first - 1;
+    while (last + 1 < free_extents->count && free_extents->runs[last + 1].start < end + (allocated ? 0 : 1)) {
+        last++;
+    }
+    Extent replacement[2];
+    int replacement_count = 0;
+    if (allocated) {
+        // Keep whatever part of the overlapped runs lies outside the range
+        if (last >= first && free_extents->runs[first].start < start) {
+            replacement[replacement_count].start = free_extents->runs[first].start;
+            replacement[replacement_count].size = start - free_extents->runs[first].start;
+            replacement_count++;
+        }
+        if (last >= first && free_extents->runs[last].start + free_extents->runs[last].size > end) {
+            replacement[replacement_count].start = end;
+            replacement[replacement_count].size = free_extents->runs[last].start + free_extents->runs[last].size - end;
+            replacement_count++;
+        }
+    } else {
+        // Merge the range with every run it overlaps or touches
+        int merged_start = start;
+        int merged_end = end;
+        if (last >= first) {
+            if (free_extents->runs[first].start < merged_start) {
+                merged_start = free_extents->runs[first].start;
+            }
+            if (free_extents->runs[last].start + free_extents->runs[last].size > merged_end) {
+                merged_end = free_extents->runs[last].start + free_extents->runs[last].size;
+            }
+        }
+        replacement[0].start = merged_start;
+        replacement[0].size = merged_end - merged_start;
+        replacement_count = 1;
+    }
+    splice_free_extents(ctx, first, last, replacement, replacement_count);
 }
 
 // Updates the free block bitmap for a contiguous range of blocks
-void update_free_blocks(int start, int size, bool allocated) {
+void update_free_blocks(FsContext *ctx, int start, int size, bool allocated) {
     // Loop through each block in the range to update
     for (int i = 0; i < size; i++) {
         int block = start + i; // Calculate the actual block number (start + offset)
         int byte_index = block / 8; // Calculate which byte in the free_block_list contains this block's bit
         int bit_index = block % 8; // Calculate which bit within the byte represents this block
         if (allocated) {
-            superblock.free_block_list[byte_index] |= (1 << (7 - bit_index)); // Mark block as allocated: set the bit to 1
+            ctx->volume->superblock.free_block_list[byte_index] |= (1 << (7 - bit_index)); // Mark block as allocated: set the bit to 1
         } else {
-            superblock.free_block_list[byte_index] &= ~(1 << (7 - bit_index)); // Mark block as free: set the bit to 0
+            ctx->volume->superblock.free_block_list[byte_index] &= ~(1 << (7 - bit_index)); // Mark block as free: set the bit to 0
         }
+        mark_bitmap_dirty(ctx, block);
+    }
+    update_free_extents(ctx, start, start + size, allocated); // Keep the free extent summary in step with the bitmap
+    if (allocated) {
+        ctx->volume->disk.next_fit_cursor = start + size; // Next-fit resumes after the most recent allocation
     }
 }
 
-// Finds a contiguous region of free blocks in the bitmap
-int find_contiguous_blocks(int size) {
-    if (size <= 0) {
-        return -1; // Invalid size
+// Selects the allocation policy by name ("first", "best" or "next"); returns -1 for an unknown name
+int set_alloc_policy(const char *name) {
+    if (strcmp(name, "first") == 0) {
+        alloc_policy = ALLOC_FIRST_FIT;
+    } else if (strcmp(name, "best") == 0) {
+        alloc_policy = ALLOC_BEST_FIT;
+    } else if (strcmp(name, "next") == 0) {
+        alloc_policy = ALLOC_NEXT_FIT;
+    } else {
+        return -1;
     }
-    // Search for contiguous free blocks starting from block 1
-    for (int start = 1; start <= 127 - size + 1; start++) {
-        bool found = true;
-        // Check if all size blocks starting from start are free
-        for (int i = 0; i < size; i++) {
-            int block = start + i;
-            int byte_index = block / 8;
-            int bit_index = block % 8;
-            // Check if bit is set (1 = allocated, 0 = free)
-            if ((superblock.free_block_list[byte_index] >> (7 - bit_index)) & 1) {
-                found = false; // Block is allocated
-                break;
+    return 0;
+}
+
+// Finds a contiguous region of free blocks using the free extent summary and the current allocation policy
+int find_contiguous_blocks(FsContext *ctx, int size) {
+    const FreeExtents *free_extents = &ctx->volume->disk.free_extents;
+    int next_fit_cursor = ctx->volume->disk.next_fit_cursor;
+    if (size <= 0 || size > free_extents->largest) {
+        return -1; // Invalid size, or no free run is large enough
+    }
+    if (alloc_policy == ALLOC_BEST_FIT) {
+        // Smallest run that fits, lowest start on ties
+        int best = -1;
+        for (int i = 0; i < free_extents->count; i++) {
+            if (free_extents->runs[i].size >= size && (best == -1 || free_extents->runs[i].size < free_extents->runs[best].size)) {
+                best = i;
             }
         }
-        // If a contiguous region of free blocks is found, return the start position
-        if (found) {
-            return start;
+        return best == -1 ? -1 : free_extents->runs[best].start;
+    }
+    if (alloc_policy == ALLOC_NEXT_FIT) {
+        // First fit at or after the cursor, including the tail of a run the cursor points into
+        for (int i = 0; i < free_extents->count; i++) {
+            int run_end = free_extents->runs[i].start + free_extents->runs[i].size;
+            int start = free_extents->runs[i].start > next_fit_cursor ? free_extents->runs[i].start : next_fit_cursor;
+            if (run_end - start >= size) {
+                return start;
+            }
+        }
+        // Wrap around to the beginning of the disk
+    }
+    // First fit: lowest run that is large enough
+    for (int i = 0; i < free_extents->count; i++) {
+        if (free_extents->runs[i].size >= size) {
+            return free_extents->runs[i].start;
         }
     }
     return -1; // No contiguous free blocks found
-}
\ No newline at end of file
+}
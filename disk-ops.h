@@ -1,13 +1,120 @@
 #ifndef DISK_OPS_H
 #define DISK_OPS_H
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "fs-sim.h"
 
-int open_disk(const char *filename);
-void close_disk(void);
-void read_block(int block_num, uint8_t *data);
-void write_block(int block_num, uint8_t *data);
-void update_free_blocks(int start, int size, bool allocated);
-int find_contiguous_blocks(int size);
+// Number of blocks held in the write-back block cache (override with -DCACHE_SIZE=n)
+#ifndef CACHE_SIZE
+#define CACHE_SIZE 32
+#endif
 
-#endif
\ No newline at end of file
+#define ZERO_CHUNK_BYTES (1 << 20) // Largest single write used to zero blocks when holes cannot be punched
+
+#define CRASH_EXIT_STATUS 99 // Exit status of a simulated crash (crash_after_writes)
+
+typedef struct {
+    unsigned long hits;       // read_block/write_block calls served by a cached block
+    unsigned long misses;     // read_block/write_block calls that needed a free or evicted slot
+    unsigned long flushes;    // dirty blocks written back to disk (on eviction or flush)
+} CacheStats;
+
+typedef struct {
+    int start; // First block of the run
+    int size;  // Number of blocks in the run
+} Extent;
+
+typedef struct {
+    int count;         // Number of free runs
+    int largest;       // Size of the largest free run
+    int capacity;      // Runs that fit in runs before it has to grow
+    Extent *runs;      // Free runs in block order
+} FreeExtents;
+
+typedef enum {
+    ALLOC_FIRST_FIT, // Lowest free run that is large enough (default)
+    ALLOC_BEST_FIT,  // Smallest free run that is large enough
+    ALLOC_NEXT_FIT   // First fit starting after the previous allocation
+} AllocPolicy;
+
+typedef enum {
+    BACKEND_FD,  // pread/pwrite through the block cache (default)
+    BACKEND_MMAP // Whole disk file memory-mapped, blocks copied in and out of the mapping
+} DiskBackend;
+
+typedef struct {
+    unsigned long reads;         // read system calls issued on the disk file
+    unsigned long writes;        // write system calls issued on the disk file
+    unsigned long bytes_read;    // bytes returned by those reads
+    unsigned long bytes_written; // bytes accepted by those writes
+    unsigned long long io_ns;    // time spent in those system calls (only measured when stats_enabled)
+    unsigned long block_reads;   // blocks requested through read_block and read_blocks, cached or not
+    unsigned long block_writes;  // blocks passed to write_block and write_blocks, cached or not
+    unsigned long punches;       // fallocate calls that zeroed blocks by punching a hole instead of writing
+    unsigned long zero_reads;    // blocks read as zeros from the zero map, without the disk or the cache
+    unsigned long zero_writes;   // zero blocks not written because the zero map knew they were zero already
+} IoStats;
+
+typedef struct {
+    int block_num;   // Disk block held in this slot
+    bool valid;      // Slot holds a block
+    bool dirty;      // Cached copy is newer than the disk copy
+    bool referenced; // CLOCK reference bit, cleared as the hand sweeps past
+    uint8_t *data;   // block_size bytes in cache_pool
+} CacheSlot;
+
+// The attached disk file of a context, its block cache and free space summary
+typedef struct {
+    int fd;                       // File descriptor of the disk file, -1 when none is attached
+    int block_size;               // Bytes per block of the attached disk
+    int num_blocks;               // Blocks on the attached disk
+    CacheSlot cache[CACHE_SIZE];  // Write-back block cache
+    uint8_t *cache_pool;          // Backing storage of the slots, CACHE_SIZE blocks
+    int *cache_slot_of;           // Block number -> slot index + 1 (0 when the block is not cached)
+    int clock_hand;               // Next slot considered for eviction
+    uint8_t *map;                 // Mapping of the whole disk file when the mmap backend is active
+    size_t map_size;              // Length of the mapping in bytes
+    bool punch_holes;             // Copy of punch_holes for this disk, cleared if its file system cannot punch holes
+    Extent *deferred_zero;        // Freed runs waiting to be zeroed by zero_deferred_blocks
+    int deferred_count;
+    int deferred_capacity;
+    FreeExtents free_extents;     // Free runs of the mounted disk, rebuilt at mount and updated by update_free_blocks
+    int next_fit_cursor;          // Block after the most recent allocation, used by next-fit
+    uint64_t *zero_map;           // Data blocks known to read back as zeros, one bit each, built at mount (NULL when not kept)
+    long writes_until_crash;      // Disk writes left before a simulated crash, 0 when none is planned
+} Disk;
+
+int open_disk(FsContext *ctx, const char *filename);
+void attach_disk(FsContext *ctx, int fd, int block_size, int num_blocks);
+void close_disk(FsContext *ctx);
+void free_disk(FsContext *ctx);
+void flush_cache(FsContext *ctx);
+void sync_disk(FsContext *ctx);
+int set_disk_backend(const char *name);
+int open_trace(const char *filename);
+void close_trace(void);
+uint8_t *block_pointer(FsContext *ctx, int block_num);
+void read_block(FsContext *ctx, int block_num, uint8_t *data);
+void write_block(FsContext *ctx, int block_num, uint8_t *data);
+void read_blocks(FsContext *ctx, int start, int count, uint8_t *data);
+void write_blocks(FsContext *ctx, int start, int count, const uint8_t *data);
+void zero_blocks(FsContext *ctx, int start, int count);
+void load_block_checksums(const FsContext *ctx, int start, int count, uint32_t *checksums);
+void store_block_checksums(FsContext *ctx, int start, int count, const uint32_t *checksums);
+void defer_zero_blocks(FsContext *ctx, int start, int count);
+void zero_deferred_blocks(FsContext *ctx);
+void update_free_blocks(FsContext *ctx, int start, int size, bool allocated);
+int find_contiguous_blocks(FsContext *ctx, int size);
+void rebuild_free_extents(FsContext *ctx);
+void rebuild_zero_map(FsContext *ctx);
+int count_zero_blocks(FsContext *ctx);
+int set_alloc_policy(const char *name);
+
+extern AllocPolicy alloc_policy;
+extern DiskBackend disk_backend;
+extern bool punch_holes;
+extern long crash_after_writes;
+extern FILE *trace_file;
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef FS_CONTEXT_H
+#define FS_CONTEXT_H
+#include <stdio.h>
+#include <pthread.h>
+#include "fs-sim.h"
+#include "disk-ops.h"
+#include "inode-ops.h"
+#include "stats.h"
+
+// Data locks of a volume; a file uses the one at its inode index modulo this (override with -DFILE_LOCK_STRIPES=n)
+#ifndef FILE_LOCK_STRIPES
+#define FILE_LOCK_STRIPES 64
+#endif
+
+// Sequential reads followed at once by each context, and the bounds of a read-ahead window
+#define READ_STREAMS 4
+#define READ_AHEAD_TRIGGER 2 // Reads in a row that continue a stream before its first window is read
+#define READ_AHEAD_MIN_BLOCKS 4
+#define READ_AHEAD_MAX_BYTES (256 * 1024)
+
+// A file read block after block by single-block R commands, and the window of its blocks read ahead of the reader
+typedef struct {
+    int inode_index;          // File of the stream, -1 for an unused stream
+    int next_block;           // File block a sequential read would ask for next
+    int sequential_reads;     // Reads in a row that asked for next_block
+    int window_size;          // Blocks the next window reads (doubled when a window is used up, halved when it is mostly wasted)
+    int window_first;         // File block at the start of the window
+    int window_count;         // Blocks in the window, 0 when there is none
+    int window_used;          // Blocks of the window served so far
+    unsigned long generation; // Volume generation the window was read at; it is stale once that changes
+    unsigned long last_use;   // Read counter of the context at the last use, for taking over the least recent stream
+    uint8_t *window;          // Window data
+    size_t window_capacity;   // Bytes allocated for it
+} ReadStream;
+
+typedef struct {
+    unsigned long windows;        // Windows read
+    unsigned long blocks_ahead;   // Blocks they read ahead of the reader
+    unsigned long hits;           // Single-block reads served from a window
+    unsigned long wasted;         // Blocks read ahead and dropped unused
+    unsigned long direct_reads;   // Single-block reads that went to read_block
+    unsigned long long direct_ns; // Time in those reads (only measured when stats_enabled)
+    unsigned long long window_ns; // Time reading windows and serving hits (only measured when stats_enabled)
+} ReadAheadStats;
+
+// A mounted disk: its superblock, block cache, free space and directory index. Commands that only read metadata
+// (R, W, L, Y, B) hold metadata_lock shared and may run on several threads at once; commands that change it (M, C, D,
+// O, S) hold it exclusive. R and W also hold the data lock of their file, shared and exclusive respectively. The
+// block cache has its own mutex, which is not held across reads and writes of whole runs.
+typedef struct {
+    char current_disk_name[1000];                  // Name of currently mounted disk
+    Superblock superblock;                         // Superblock of the mounted disk
+    bool is_mounted;                               // A file system is mounted
+    bool superblock_dirty;                         // In-memory superblock has changes not yet written to disk
+    bool *metadata_dirty;                          // Metadata blocks (0 to data_start - 1) changed since the last sync point
+    int pending_mutations;                         // Superblock mutations since the last sync point
+    Disk disk;                                     // Disk file, block cache and free space
+    DirIndex index;                                // Directory index
+    pthread_rwlock_t metadata_lock;                // Superblock, directory index and free space
+    pthread_rwlock_t file_locks[FILE_LOCK_STRIPES]; // File data
+    pthread_mutex_t cache_lock;                    // Block cache slots and the slot table
+    unsigned long metadata_generation;             // Counts the times metadata_lock was taken exclusive
+    unsigned long data_generation[FILE_LOCK_STRIPES]; // Counts the times each data lock was taken exclusive
+} FsVolume;
+
+// Everything one file system instance works on: a volume, the current directory, the buffer, the output streams and
+// the statistics. A context normally owns its volume and shares nothing, so one thread per context can drive several
+// disks at once. A context made with init_shared_context works on the volume of another context instead, so threads
+// with one context each can run commands against the same mounted disk. A context points into itself (volume and
+// buffer), so it must not be copied once initialized.
+struct FsContext {
+    FsVolume *volume;                      // own_volume, or the volume of the context this one shares with
+    FsVolume own_volume;                   // Volume of a context that does not share
+    int current_inode_index;               // Current working directory
+    const char *path_directory;            // Directory part of the running command's path argument ("a/b" of a/b/f, "/" of /f)
+    int path_directory_length;             // Its length; 0 for a bare name, which names an entry of the current directory
+    uint8_t *buffer;                       // Buffer of at least one block of the mounted disk (more after a range read or write)
+    size_t buffer_size;                    // Buffer size
+    uint8_t default_buffer[V1_BLOCK_SIZE]; // Buffer used until a larger one is needed
+    CommandStats stats;                    // Command latencies
+    CacheStats cache_stats;                // Block cache use by this context's commands
+    IoStats io_stats;                      // Disk I/O done by this context's commands
+    LookupStats lookup_stats;              // Directory index use by this context's commands
+    int corrupt_block;                     // First block whose checksum failed in a read since this was reset to -1
+    char command;                          // Letter of the command being run, 0 between commands (for the I/O trace)
+    int command_line;                      // Its line in the command file
+    ReadStream read_streams[READ_STREAMS]; // Sequential reads being followed
+    unsigned long read_clock;              // Single-block reads so far, the clock of last_use
+    ReadAheadStats read_ahead_stats;       // Read-ahead use by this context's commands
+    FILE *out;                             // Output of the L and T commands
+    FILE *err;                             // Error messages
+};
+
+#endif
@@ -1,393 +1,1696 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include "fs-sim.h"
-#include "disk-ops.h"
-#include "inode-ops.h"
-
-char current_disk_name[1000] = ""; // Name of currently mounted disk
-Superblock superblock; // Superblock
-uint8_t buffer[1024]; // Buffer size
-int current_inode_index = 127; // Currently in the root directory
-bool is_mounted = false; // File system not mounted yet
-int disk_fd = -1; // File descriptor for disk file
-
-// Performs comprehensive consistency checks on a file system superblock
-int check_consistency(Superblock *sb, char *disk_name) {
-    // Check 1: Free inodes must be all 0s
-    for (int i = 0; i < 126; i++) {
-        if (!(sb->inode[i].isused_size & 0x80)) {
-            for (int j = 0; j < 5; j++) {
-                if (sb->inode[i].name[j] != 0) {
-                    return 1;
-                }
-            }
-            if (sb->inode[i].isused_size != 0 || sb->inode[i].start_block != 0 || sb->inode[i].isdir_parent != 0) {
-                return 1;
-            }
-        } else {
-            // Inode is in use, check if name starts with zero byte
-            if (sb->inode[i].name[0] == 0) {
-                return 1;
+#include "fs-context.h"
+#include "checksum.h"
+#include "journal.h"
+
+static const uint8_t v2_magic[8] = {0, 'F', 'S', 'I', 'M', 'v', '2', 0}; // Leading zero byte: block 0 of a version 1 disk is always allocated
+
+bool report_all_violations = false; // Report every consistency violation found at mount, not just the error code
+int read_ahead_blocks = 64; // Largest read-ahead window in blocks (FS_READ_AHEAD), also bounded by READ_AHEAD_MAX_BYTES; 0 turns read-ahead off
+
+// Number of inodes stored in each inode table block of a version 2 disk
+static uint32_t inodes_per_block(const Superblock *sb) {
+    return sb->block_size / sizeof(Inode);
+}
+
+// Number of bytes of the free block bitmap
+static uint32_t bitmap_bytes(const Superblock *sb) {
+    return (sb->num_blocks + 7) / 8;
+}
+
+// Returns true if the free block bitmap marks a block as allocated
+static bool block_is_allocated(const Superblock *sb, uint32_t block) {
+    return (sb->free_block_list[block / 8] >> (7 - block % 8)) & 1;
+}
+
+// Fills in the fixed geometry of a version 1 disk
+static void v1_layout(Superblock *sb) {
+    sb->version = 1;
+    sb->block_size = V1_BLOCK_SIZE;
+    sb->num_blocks = V1_NUM_BLOCKS;
+    sb->num_inodes = V1_NUM_INODES;
+    sb->root = V1_NUM_INODES + 1;
+    sb->bitmap_start = 0;
+    sb->inode_start = 0;
+    sb->data_start = 1;
+}
+
+// Number of blocks of the checksum table of a disk (one 4-byte entry per block)
+static uint32_t checksum_blocks(const Superblock *sb) {
+    return ((uint64_t)sb->num_blocks * sizeof(uint32_t) + sb->block_size - 1) / sb->block_size;
+}
+
+// Places the bitmap, inode table, checksum table, journal (a commit block, then a slot for each block before the
+// journal) and data of a version 2 disk; returns -1 if the geometry is not usable
+static int v2_layout(Superblock *sb, uint32_t block_size, uint32_t num_blocks, uint32_t num_inodes, uint32_t features) {
+    // Block size must be a power of two that can hold the header and at least one inode
+    if (block_size < V2_MIN_BLOCK_SIZE || block_size > V2_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        return -1;
+    }
+    // Sizes and parent indices (including the root index num_inodes + 1) must fit in 31 bits
+    if (num_inodes < 1 || num_inodes > INODE_FIELD_MASK - 2 || num_blocks < 2 || num_blocks > INODE_FIELD_MASK) {
+        return -1;
+    }
+    sb->version = 2;
+    sb->block_size = block_size;
+    sb->num_blocks = num_blocks;
+    sb->num_inodes = num_inodes;
+    sb->root = num_inodes + 1;
+    uint64_t bitmap_blocks = (((uint64_t)num_blocks + 7) / 8 + block_size - 1) / block_size;
+    uint64_t inode_blocks = ((uint64_t)num_inodes + block_size / sizeof(Inode) - 1) / (block_size / sizeof(Inode));
+    uint64_t table_blocks = features & FEATURE_CHECKSUMS ? checksum_blocks(sb) : 0;
+    uint64_t journal_start = 1 + bitmap_blocks + inode_blocks + table_blocks;
+    bool journal = features & FEATURE_JOURNAL;
+    uint64_t journal_blocks = journal ? 1 + journal_start : 0;
+    if (journal && journal_start > journal_map_capacity(block_size)) {
+        return -1; // The commit block cannot map every metadata block
+    }
+    if (journal_start + journal_blocks >= num_blocks) {
+        return -1; // No room left for data
+    }
+    sb->bitmap_start = 1;
+    sb->inode_start = 1 + bitmap_blocks;
+    sb->checksum_start = table_blocks ? sb->inode_start + inode_blocks : 0;
+    sb->journal_start = journal ? journal_start : 0;
+    sb->data_start = journal_start + journal_blocks;
+    return 0;
+}
+
+// Allocates the bitmap (rounded up to whole 64-bit words) and inode table of a superblock, zero-filled
+static int alloc_superblock(Superblock *sb) {
+    sb->free_block_list = calloc((bitmap_bytes(sb) + 7) / 8, 8);
+    sb->inode = calloc(sb->num_inodes, sizeof(Inode));
+    sb->extents = calloc(sb->num_inodes, sizeof(ExtentList));
+    if (sb->checksum_start) {
+        sb->block_checksums = calloc((size_t)checksum_blocks(sb) * sb->block_size, 1); // Whole blocks, for encoding
+    }
+    if (!sb->free_block_list || !sb->inode || !sb->extents || (sb->checksum_start && !sb->block_checksums)) {
+        free_superblock(sb);
+        return -1;
+    }
+    return 0;
+}
+
+// Releases the bitmap, inode table and extent lists of a superblock
+void free_superblock(Superblock *sb) {
+    for (uint32_t i = 0; sb->extents && i < sb->num_inodes; i++) {
+        free(sb->extents[i].runs);
+    }
+    free(sb->free_block_list);
+    free(sb->inode);
+    free(sb->extents);
+    free(sb->block_checksums);
+    sb->free_block_list = NULL;
+    sb->inode = NULL;
+    sb->extents = NULL;
+    sb->block_checksums = NULL;
+}
+
+// Largest number of runs the extent block of a file can hold
+static uint32_t max_extents(const Superblock *sb) {
+    return (sb->block_size - sizeof(uint32_t)) / (2 * sizeof(uint32_t));
+}
+
+// Decodes an extent block (a run count, then a start and count per run) into list; leaves list empty if the count is invalid
+static void decode_extent_block(const Superblock *sb, const uint8_t *data, ExtentList *list) {
+    uint32_t count;
+    memcpy(&count, data, sizeof(count));
+    list->count = 0;
+    if (count < 1 || count > max_extents(sb)) {
+        return;
+    }
+    list->runs = malloc(count * sizeof(FileExtent));
+    if (!list->runs) {
+        return;
+    }
+    uint32_t logical = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        memcpy(&list->runs[k].start, data + sizeof(uint32_t) + k * 2 * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&list->runs[k].count, data + 2 * sizeof(uint32_t) + k * 2 * sizeof(uint32_t), sizeof(uint32_t));
+        list->runs[k].logical = logical;
+        logical += list->runs[k].count; // Wraps only on a corrupt list, which the consistency check rejects
+    }
+    list->count = count;
+}
+
+// Returns the runs of a file in file order: its extent list, or a single run filled into single for a contiguous file
+static uint32_t file_runs(const Superblock *sb, uint32_t inode_index, FileExtent *single, const FileExtent **runs) {
+    const Inode *inode = &sb->inode[inode_index];
+    if (inode->flags & INODE_EXTENTS) {
+        *runs = sb->extents[inode_index].runs;
+        return sb->extents[inode_index].count;
+    }
+    single->logical = 0;
+    single->start = inode->start_block;
+    single->count = inode->isused_size & INODE_FIELD_MASK;
+    *runs = single;
+    return 1;
+}
+
+// Reads count bytes at a byte offset of a disk file; returns -1 on a short read
+static int read_at(int fd, off_t offset, void *data, size_t count) {
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    return read(fd, data, count) == (ssize_t)count ? 0 : -1;
+}
+
+// Loads the superblock of a disk file of either version; returns 0, -1 if it cannot be read, -2 if a version 2 header is invalid
+int load_superblock(int fd, Superblock *sb) {
+    memset(sb, 0, sizeof(Superblock));
+    uint8_t block_data[V1_BLOCK_SIZE];
+    // Read block 0 (superblock)
+    if (read_at(fd, 0, block_data, V1_BLOCK_SIZE) == -1) {
+        return -1;
+    }
+    SuperblockV2Header header;
+    memcpy(&header, block_data, sizeof(header));
+    if (memcmp(header.magic, v2_magic, sizeof(v2_magic)) != 0) {
+        // Version 1: bitmap and 126 packed inodes in block 0
+        SuperblockV1 v1;
+        memcpy(&v1, block_data, sizeof(v1));
+        v1_layout(sb);
+        if (alloc_superblock(sb) == -1) {
+            return -1;
+        }
+        memcpy(sb->free_block_list, v1.free_block_list, sizeof(v1.free_block_list));
+        for (int i = 0; i < V1_NUM_INODES; i++) {
+            memcpy(sb->inode[i].name, v1.inode[i].name, 5);
+            sb->inode[i].isused_size = (v1.inode[i].isused_size & 0x80 ? INODE_USED : 0) | (v1.inode[i].isused_size & 0x7F);
+            sb->inode[i].start_block = v1.inode[i].start_block;
+            sb->inode[i].isdir_parent = (v1.inode[i].isdir_parent & 0x80 ? INODE_DIR : 0) | (v1.inode[i].isdir_parent & 0x7F);
+        }
+        return 0;
+    }
+    // Version 2: the header must describe exactly the layout its geometry implies
+    uint32_t features = (header.journal_start ? FEATURE_JOURNAL : 0) | (header.checksum_start ? FEATURE_CHECKSUMS : 0);
+    if (header.version != 2 || v2_layout(sb, header.block_size, header.num_blocks, header.num_inodes, features) == -1 ||
+        header.bitmap_start != sb->bitmap_start || header.inode_start != sb->inode_start || header.data_start != sb->data_start ||
+        header.journal_start != sb->journal_start || header.checksum_start != sb->checksum_start) {
+        return -2;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sb->num_blocks * sb->block_size) {
+        return -2; // Disk file is shorter than the geometry says
+    }
+    if (alloc_superblock(sb) == -1) {
+        return -1;
+    }
+    // Read the bitmap in one go, then the inode table one block's worth of inodes at a time
+    off_t bitmap_offset = (off_t)sb->bitmap_start * sb->block_size;
+    uint32_t per_block = inodes_per_block(sb);
+    int status = read_at(fd, bitmap_offset, sb->free_block_list, bitmap_bytes(sb));
+    for (uint32_t first = 0; status == 0 && first < sb->num_inodes; first += per_block) {
+        uint32_t count = sb->num_inodes - first < per_block ? sb->num_inodes - first : per_block;
+        off_t offset = (off_t)(sb->inode_start + first / per_block) * sb->block_size;
+        status = read_at(fd, offset, &sb->inode[first], count * sizeof(Inode));
+    }
+    if (status == 0 && sb->checksum_start) {
+        status = read_at(fd, (off_t)sb->checksum_start * sb->block_size, sb->block_checksums, (size_t)checksum_blocks(sb) * sb->block_size);
+    }
+    // Load the extent list of every extent-mapped file (one it cannot read stays empty and fails the consistency check)
+    uint8_t *extent_block = NULL;
+    for (uint32_t i = 0; status == 0 && i < sb->num_inodes; i++) {
+        Inode *inode = &sb->inode[i];
+        if (!(inode->isused_size & INODE_USED) || (inode->isdir_parent & INODE_DIR) || !(inode->flags & INODE_EXTENTS)) {
+            continue;
+        }
+        if (!extent_block && !(extent_block = malloc(sb->block_size))) {
+            status = -1;
+            break;
+        }
+        if (inode->start_block >= sb->data_start && inode->start_block < sb->num_blocks &&
+            read_at(fd, (off_t)inode->start_block * sb->block_size, extent_block, sb->block_size) == 0) {
+            decode_extent_block(sb, extent_block, &sb->extents[i]);
+        }
+    }
+    free(extent_block);
+    if (status == -1) {
+        free_superblock(sb);
+    }
+    return status;
+}
+
+// Encodes metadata block block_num of a superblock into out (block_size bytes); journal blocks encode as zeros
+void encode_metadata_block(const Superblock *sb, uint32_t block_num, uint8_t *out) {
+    memset(out, 0, sb->block_size);
+    if (sb->version == 1) {
+        // Pack the bitmap and inode table back into the original 8-byte inodes
+        SuperblockV1 v1;
+        memcpy(v1.free_block_list, sb->free_block_list, sizeof(v1.free_block_list));
+        for (int i = 0; i < V1_NUM_INODES; i++) {
+            memcpy(v1.inode[i].name, sb->inode[i].name, 5);
+            v1.inode[i].isused_size = (sb->inode[i].isused_size & INODE_USED ? 0x80 : 0) | (sb->inode[i].isused_size & 0x7F);
+            v1.inode[i].start_block = sb->inode[i].start_block;
+            v1.inode[i].isdir_parent = (sb->inode[i].isdir_parent & INODE_DIR ? 0x80 : 0) | (sb->inode[i].isdir_parent & 0x7F);
+        }
+        memcpy(out, &v1, sizeof(v1));
+    } else if (block_num == 0) {
+        SuperblockV2Header header;
+        memcpy(header.magic, v2_magic, sizeof(v2_magic));
+        header.version = 2;
+        header.block_size = sb->block_size;
+        header.num_blocks = sb->num_blocks;
+        header.num_inodes = sb->num_inodes;
+        header.bitmap_start = sb->bitmap_start;
+        header.inode_start = sb->inode_start;
+        header.data_start = sb->data_start;
+        header.journal_start = sb->journal_start;
+        header.checksum_start = sb->checksum_start;
+        memcpy(out, &header, sizeof(header));
+    } else if (block_num < sb->inode_start) {
+        uint32_t first = (block_num - sb->bitmap_start) * sb->block_size;
+        uint32_t count = bitmap_bytes(sb) - first < sb->block_size ? bitmap_bytes(sb) - first : sb->block_size;
+        memcpy(out, sb->free_block_list + first, count);
+    } else if (block_num < sb->inode_start + (sb->num_inodes + inodes_per_block(sb) - 1) / inodes_per_block(sb)) {
+        uint32_t per_block = inodes_per_block(sb);
+        uint32_t first = (block_num - sb->inode_start) * per_block;
+        uint32_t count = sb->num_inodes - first < per_block ? sb->num_inodes - first : per_block;
+        memcpy(out, &sb->inode[first], count * sizeof(Inode));
+    } else if (sb->checksum_start && block_num < sb->checksum_start + checksum_blocks(sb)) {
+        memcpy(out, (const uint8_t *)sb->block_checksums + (size_t)(block_num - sb->checksum_start) * sb->block_size, sb->block_size);
+    }
+}
+
+// Creates (or truncates) a disk file and writes an empty file system with the given geometry; returns 0 on success
+int format_disk(const char *disk_name, int version, uint32_t block_size, uint32_t num_blocks, uint32_t num_inodes, uint32_t features) {
+    Superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    if (version == 1 && features == 0) {
+        v1_layout(&sb);
+    } else if (version != 2 || v2_layout(&sb, block_size, num_blocks, num_inodes, features) == -1) {
+        return -1;
+    }
+    if (alloc_superblock(&sb) == -1) {
+        return -1;
+    }
+    for (uint32_t block = 0; block < sb.data_start; block++) {
+        sb.free_block_list[block / 8] |= 1 << (7 - block % 8); // Metadata blocks are always allocated
+    }
+    int fd = open(disk_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free_superblock(&sb);
+        return -1;
+    }
+    // Size the file without writing its data blocks (they read back as zeros), then write the metadata
+    int status = ftruncate(fd, (off_t)sb.num_blocks * sb.block_size);
+    uint8_t *block_data = malloc(sb.block_size);
+    for (uint32_t block = 0; status == 0 && block < sb.data_start; block++) {
+        encode_metadata_block(&sb, block, block_data);
+        if (lseek(fd, (off_t)block * sb.block_size, SEEK_SET) == -1 || write(fd, block_data, sb.block_size) != (ssize_t)sb.block_size) {
+            status = -1;
+        }
+    }
+    free(block_data);
+    free_superblock(&sb);
+    close(fd);
+    return status;
+}
+
+// Prepares a context with nothing mounted; output of the L and T commands goes to out, error messages to err
+void init_context(FsContext *ctx, FILE *out, FILE *err) {
+    memset(ctx, 0, sizeof(FsContext));
+    ctx->volume = &ctx->own_volume;
+    ctx->current_inode_index = V1_NUM_INODES + 1; // Root directory of a version 1 disk
+    ctx->buffer = ctx->default_buffer;
+    ctx->buffer_size = V1_BLOCK_SIZE;
+    ctx->corrupt_block = -1;
+    for (int i = 0; i < READ_STREAMS; i++) {
+        ctx->read_streams[i].inode_index = -1;
+    }
+    ctx->volume->disk.fd = -1;
+    ctx->volume->disk.block_size = V1_BLOCK_SIZE;
+    ctx->volume->disk.num_blocks = V1_NUM_BLOCKS;
+    ctx->volume->disk.next_fit_cursor = 1;
+    pthread_rwlock_init(&ctx->volume->metadata_lock, NULL);
+    for (int i = 0; i < FILE_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&ctx->volume->file_locks[i], NULL);
+    }
+    pthread_mutex_init(&ctx->volume->cache_lock, NULL);
+    ctx->out = out;
+    ctx->err = err;
+}
+
+// Closes the disk of a context (writing back pending changes) and releases everything it holds; the context can mount
+// a disk again afterwards. A context that shares another's volume only releases its buffer.
+void free_context(FsContext *ctx) {
+    if (ctx->volume == &ctx->own_volume) {
+        sync_superblock(ctx);
+        free_disk(ctx);
+        free_dir_index(ctx);
+        free_superblock(&ctx->volume->superblock);
+        free(ctx->volume->metadata_dirty);
+        ctx->volume->metadata_dirty = NULL;
+        ctx->volume->is_mounted = false;
+    }
+    if (ctx->buffer != ctx->default_buffer) {
+        free(ctx->buffer);
+    }
+    ctx->buffer = ctx->default_buffer;
+    ctx->buffer_size = V1_BLOCK_SIZE;
+    for (int i = 0; i < READ_STREAMS; i++) {
+        free(ctx->read_streams[i].window);
+        ctx->read_streams[i] = (ReadStream){.inode_index = -1};
+    }
+}
+
+// Records a superblock mutation; metadata is only rewritten at a sync point
+void mark_superblock_dirty(FsContext *ctx) {
+    ctx->volume->pending_mutations++;
+    if (ctx->volume->pending_mutations >= SYNC_INTERVAL) {
+        sync_superblock(ctx); // Bound the number of mutations that can be lost
+    }
+}
+
+// Marks the metadata block holding an inode as changed
+void mark_inode_dirty(FsContext *ctx, int inode_index) {
+    if (ctx->volume->metadata_dirty) {
+        uint32_t block = ctx->volume->superblock.version == 1 ? 0 : ctx->volume->superblock.inode_start + inode_index / inodes_per_block(&ctx->volume->superblock);
+        ctx->volume->metadata_dirty[block] = true;
+        ctx->volume->superblock_dirty = true;
+    }
+}
+
+// Marks the metadata block holding the bitmap bit of a block as changed
+void mark_bitmap_dirty(FsContext *ctx, int block_num) {
+    if (ctx->volume->metadata_dirty) {
+        uint32_t block = ctx->volume->superblock.version == 1 ? 0 : ctx->volume->superblock.bitmap_start + block_num / 8 / ctx->volume->superblock.block_size;
+        ctx->volume->metadata_dirty[block] = true;
+        ctx->volume->superblock_dirty = true;
+    }
+}
+
+// Marks the metadata block holding the checksum of a block as changed; the caller holds the cache lock, since writers of
+// different files update the table at the same time
+void mark_checksum_dirty(FsContext *ctx, int block_num) {
+    if (ctx->volume->metadata_dirty) {
+        ctx->volume->metadata_dirty[ctx->volume->superblock.checksum_start + block_num * sizeof(uint32_t) / ctx->volume->superblock.block_size] = true;
+        ctx->volume->superblock_dirty = true;
+    }
+}
+
+// Writes the changed metadata blocks to the disk if the superblock changed since the last sync point, as one journal
+// transaction on a disk that has a journal
+void sync_superblock(FsContext *ctx) {
+    if (ctx->volume->superblock_dirty && ctx->volume->disk.fd != -1 && ctx->volume->superblock.journal_start) {
+        if (journal_commit(ctx) == -1) {
+            return; // Out of memory: the blocks stay dirty until the next sync point
+        }
+    } else if (ctx->volume->superblock_dirty && ctx->volume->disk.fd != -1) {
+        uint8_t *block_data = malloc(ctx->volume->superblock.block_size);
+        for (uint32_t block = 0; block_data && block < ctx->volume->superblock.data_start; block++) {
+            if (ctx->volume->metadata_dirty[block]) {
+                encode_metadata_block(&ctx->volume->superblock, block, block_data);
+                write_block(ctx, block, block_data);
+                ctx->volume->metadata_dirty[block] = false;
             }
         }
+        free(block_data);
     }
-    // Check 2: File inodes must have valid start block and size
-    for (int i = 0; i < 126; i++) {
-        if (sb->inode[i].isused_size & 0x80) {
-            bool is_dir = sb->inode[i].isdir_parent & 0x80;
-            int size = sb->inode[i].isused_size & 0x7F;
-            int start = sb->inode[i].start_block;
-            if (!is_dir) {
-                // Files must have valid block range (1-127)
-                if (start < 1 || start > 127) {
-                    return 2;
-                }
-                // File extends beyond disk
-                if (start + size - 1 > 127) {
-                    return 2;
+    ctx->volume->superblock_dirty = false;
+    ctx->volume->pending_mutations = 0;
+}
+
+// Grows the buffer to at least new_size bytes, keeping its contents and zero-filling the new part; returns false if out of memory
+static bool reserve_buffer(FsContext *ctx, size_t new_size) {
+    if (new_size <= ctx->buffer_size) {
+        return true;
+    }
+    uint8_t *new_buffer = ctx->buffer == ctx->default_buffer ? malloc(new_size) : realloc(ctx->buffer, new_size);
+    if (!new_buffer) {
+        return false;
+    }
+    if (ctx->buffer == ctx->default_buffer) {
+        memcpy(new_buffer, ctx->default_buffer, ctx->buffer_size);
+    }
+    memset(new_buffer + ctx->buffer_size, 0, new_size - ctx->buffer_size);
+    ctx->buffer = new_buffer;
+    ctx->buffer_size = new_size;
+    return true;
+}
+
+// Prepares a context that runs commands against the volume of owner, starting in its root directory. The owner must
+// outlive the context and must not mount another disk while it exists; the context itself cannot mount (M).
+void init_shared_context(FsContext *ctx, FsContext *owner, FILE *out, FILE *err) {
+    init_context(ctx, out, err);
+    ctx->volume = owner->volume;
+    pthread_rwlock_rdlock(&ctx->volume->metadata_lock);
+    if (ctx->volume->is_mounted) {
+        ctx->current_inode_index = ctx->volume->superblock.root;
+        reserve_buffer(ctx, ctx->volume->superblock.block_size);
+    }
+    pthread_rwlock_unlock(&ctx->volume->metadata_lock);
+}
+
+// Takes the metadata lock of the context's volume, exclusive for commands that change metadata
+static void lock_metadata(FsContext *ctx, bool exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&ctx->volume->metadata_lock);
+        ctx->volume->metadata_generation++; // Files may be remapped or rewritten: read-ahead windows are stale
+    } else {
+        pthread_rwlock_rdlock(&ctx->volume->metadata_lock);
+    }
+}
+
+static void unlock_metadata(FsContext *ctx) {
+    pthread_rwlock_unlock(&ctx->volume->metadata_lock);
+}
+
+// Returns the block size of the mounted disk (that of a version 1 disk if none is mounted)
+int fs_block_size(const FsContext *ctx) {
+    return ctx->volume->is_mounted ? (int)ctx->volume->superblock.block_size : V1_BLOCK_SIZE;
+}
+
+// Returns the largest file size in blocks on the mounted disk (that of a version 1 disk if none is mounted)
+int fs_max_file_blocks(const FsContext *ctx) {
+    return ctx->volume->is_mounted ? (int)(ctx->volume->superblock.num_blocks - ctx->volume->superblock.data_start) : V1_NUM_BLOCKS - 1;
+}
+
+// Describes each consistency check for the violation report
+static const char *check_descriptions[7] = {
+    "",
+    "free inode is not zeroed, or used inode has an empty name",
+    "file start block or size lies outside the disk",
+    "directory has a non-zero size or start block",
+    "parent is not a valid directory",
+    "name is not unique in its directory",
+    "file uses a block marked free"
+};
+
+// Records that an inode violates a check; keeps the code the checks would report when run one after another
+static void record_violation(FsContext *ctx, int *error_code, int code, int inode_index, char *disk_name) {
+    if (report_all_violations) {
+        fprintf(ctx->err, "Consistency: %s: inode %d violates check %d (%s)\n", disk_name, inode_index, code, check_descriptions[code]);
+    }
+    // Checks 2 and 3 share one sweep, so the first offending inode decides between them
+    int group = code == 3 ? 2 : code;
+    int current_group = *error_code == 3 ? 2 : *error_code;
+    if (*error_code == 0 || group < current_group) {
+        *error_code = code;
+    }
+}
+
+// Performs comprehensive consistency checks on a file system superblock in a single sweep of the inode table
+int check_consistency(FsContext *ctx, Superblock *sb, char *disk_name) {
+    int error_code = 0;
+    // Which file claims each block first, only tracked for the violation report
+    int *block_owner = NULL;
+    if (report_all_violations) {
+        block_owner = malloc(sb->num_blocks * sizeof(int));
+        for (uint32_t i = 0; block_owner && i < sb->num_blocks; i++) {
+            block_owner[i] = -1;
+        }
+    }
+    // Open-addressing hash of (parent, name) for the unique name check, at most half full
+    uint32_t name_slots = 256;
+    while (name_slots < 2 * sb->num_inodes) {
+        name_slots *= 2;
+    }
+    int *name_slot = malloc(name_slots * sizeof(int));
+    if (!name_slot) {
+        free(block_owner);
+        return 1;
+    }
+    for (uint32_t i = 0; i < name_slots; i++) {
+        name_slot[i] = -1;
+    }
+    static const Inode zero_inode;
+    for (uint32_t i = 0; i < sb->num_inodes; i++) {
+        Inode *inode = &sb->inode[i];
+        if (!(inode->isused_size & INODE_USED)) {
+            // Check 1: Free inodes must be all 0s
+            if (memcmp(inode, &zero_inode, sizeof(Inode)) != 0) {
+                record_violation(ctx, &error_code, 1, i, disk_name);
+            }
+            continue;
+        }
+        // Check 1: Inode is in use, its name cannot start with a zero byte
+        if (inode->name[0] == 0) {
+            record_violation(ctx, &error_code, 1, i, disk_name);
+        }
+        bool is_dir = inode->isdir_parent & INODE_DIR;
+        uint32_t size = inode->isused_size & INODE_FIELD_MASK;
+        uint32_t start = inode->start_block;
+        bool blocks_in_range = true;
+        FileExtent single;
+        const FileExtent *runs;
+        uint32_t run_count = file_runs(sb, i, &single, &runs);
+        if (!is_dir) {
+            // Check 2: Files must start in the data area and not extend beyond the disk
+            if (start < sb->data_start || start >= sb->num_blocks || (!(inode->flags & INODE_EXTENTS) && size > sb->num_blocks - start)) {
+                record_violation(ctx, &error_code, 2, i, disk_name);
+                blocks_in_range = false;
+            } else if (inode->flags & INODE_EXTENTS) {
+                // Every run of an extent-mapped file must lie in the data area, and the runs must add up to the file size
+                uint64_t total = 0;
+                for (uint32_t k = 0; k < run_count && blocks_in_range; k++) {
+                    total += runs[k].count;
+                    blocks_in_range = runs[k].count > 0 && runs[k].start >= sb->data_start && runs[k].start < sb->num_blocks &&
+                                      runs[k].count <= sb->num_blocks - runs[k].start;
                 }
-            } else {
-                // Check 3: Directory size and start block must be zero
-                if (size != 0 || start != 0) {
-                    return 3;
+                if (run_count == 0 || !blocks_in_range || total != size) {
+                    record_violation(ctx, &error_code, 2, i, disk_name);
+                    blocks_in_range = false;
                 }
             }
+        } else if (size != 0 || start != 0 || inode->flags != 0) {
+            // Check 3: Directory size and start block must be zero
+            record_violation(ctx, &error_code, 3, i, disk_name);
         }
-    }
-    // Check 4: Parent inode validation
-    for (int i = 0; i < 126; i++) {
-        if (sb->inode[i].isused_size & 0x80) {
-            int parent_index = sb->inode[i].isdir_parent & 0x7F;
-            // An inode cannot be its own parent
-            if (parent_index == i || parent_index == 126) {
-                return 4;
+        // Check 4: An inode cannot be its own parent, and a parent other than the root must be a used directory
+        uint32_t parent_index = inode->isdir_parent & INODE_FIELD_MASK;
+        bool parent_is_dir = false;
+        if (parent_index == i || parent_index == sb->num_inodes) {
+            record_violation(ctx, &error_code, 4, i, disk_name);
+        } else if (parent_index != sb->root) {
+            parent_is_dir = parent_index < sb->num_inodes && (sb->inode[parent_index].isused_size & INODE_USED) && (sb->inode[parent_index].isdir_parent & INODE_DIR);
+            if (!parent_is_dir) {
+                record_violation(ctx, &error_code, 4, i, disk_name);
             }
-            // Parent must be valid
-            if (parent_index != 127) {
-                if (parent_index < 0 || parent_index > 125) {
-                    return 4;
-                }
-                // Parent must exist and be a directory
-                if (!(sb->inode[parent_index].isused_size & 0x80) || !(sb->inode[parent_index].isdir_parent & 0x80)) {
-                    return 4;
+        }
+        // Check 5: Unique names in each directory (entries of the root are not compared, as before)
+        if (parent_is_dir) {
+            uint32_t hash = 2166136261u ^ parent_index; // FNV-1a over the parent index and the 5 name bytes
+            for (int j = 0; j < 5; j++) {
+                hash = (hash ^ (uint8_t)inode->name[j]) * 16777619u;
+            }
+            uint32_t slot = hash & (name_slots - 1);
+            while (name_slot[slot] != -1) {
+                Inode *other = &sb->inode[name_slot[slot]];
+                if ((other->isdir_parent & INODE_FIELD_MASK) == parent_index && memcmp(other->name, inode->name, 5) == 0) {
+                    record_violation(ctx, &error_code, 5, i, disk_name);
+                    break;
                 }
+                slot = (slot + 1) & (name_slots - 1);
+            }
+            if (name_slot[slot] == -1) {
+                name_slot[slot] = i;
             }
         }
-    }
-    // Check 5: Unique names in each directory
-    for (int parent = 0; parent < 126; parent++) {
-        if (sb->inode[parent].isused_size & 0x80 && (sb->inode[parent].isdir_parent & 0x80)) {
-            // Check all children of this directory for duplicates
-            for (int i = 0; i < 126; i++) {
-                if (sb->inode[i].isused_size & 0x80 && (sb->inode[i].isdir_parent & 0x7F) == parent) {
-                    for (int j = i + 1; j < 126; j++) {
-                        if (sb->inode[j].isused_size & 0x80 && (sb->inode[j].isdir_parent & 0x7F) == parent && 
-                            memcmp(sb->inode[i].name, sb->inode[j].name, 5) == 0) {
-                            return 5;
+        // Check 6: Files must only use blocks the free space list marks as allocated (the extent block included)
+        if (!is_dir && blocks_in_range) {
+            FileExtent extent_block = {0, start, 1};
+            bool has_extent_block = inode->flags & INODE_EXTENTS;
+            bool all_allocated = true;
+            for (uint32_t k = 0; k < run_count + has_extent_block && all_allocated; k++) {
+                const FileExtent *run = k < run_count ? &runs[k] : &extent_block;
+                for (uint32_t j = run->start; j < run->start + run->count; j++) {
+                    if (!block_is_allocated(sb, j)) {
+                        record_violation(ctx, &error_code, 6, i, disk_name);
+                        all_allocated = false;
+                        break;
+                    }
+                    if (block_owner) {
+                        // Shared blocks are not an error code of their own, but are worth knowing about during triage
+                        if (block_owner[j] != -1) {
+                            fprintf(ctx->err, "Consistency: %s: inode %d shares block %u with inode %d\n", disk_name, i, j, block_owner[j]);
                         }
+                        block_owner[j] = i;
                     }
                 }
             }
         }
-    }
-    // Check 6: Free space list consistency
-    bool block_allocated[128] = {false};
-    for (int i = 0; i < 128; i++) {
-        int byte_index = i / 8;
-        int bit_index = i % 8;
-        bool is_allocated = (sb->free_block_list[byte_index] >> (7 - bit_index)) & 1;
-        if (is_allocated) block_allocated[i] = true;
-    }
-    // Verify files use allocated blocks
-    for (int i = 0; i < 126; i++) {
-        if (sb->inode[i].isused_size & 0x80 && !(sb->inode[i].isdir_parent & 0x80)) {
-            int start = sb->inode[i].start_block;
-            int size = sb->inode[i].isused_size & 0x7F;
-            for (int j = start; j < start + size; j++) {
-                if (!block_allocated[j]) {
-                    return 6;
-                }
-            }
+        if (error_code == 1 && !report_all_violations) {
+            break; // Nothing found later can lower the result
         }
     }
-    return 0; // All checks passed
+    free(name_slot);
+    free(block_owner);
+    return error_code; // 0 if all checks passed
 }
 
 // Mounts the file system residing on the specified virtual disk
-void fs_mount(char *new_disk_name) {
+static void mount_disk(FsContext *ctx, char *new_disk_name) {
+    sync_superblock(ctx); // Persist the current disk first so a remount of the same disk reads current data
+    flush_cache(ctx);
     int new_fd = open(new_disk_name, O_RDWR); // Try to open the new disk
     if (new_fd == -1) {
-        fprintf(stderr, "Error: Cannot find disk %s\n", new_disk_name);
+        fprintf(ctx->err, "Error: Cannot find disk %s\n", new_disk_name);
         return;
     }
     Superblock new_sb; // Read superblock from new disk
-    uint8_t block_data[1024];
-    // Read block 0 (superblock)
-    if (lseek(new_fd, 0, SEEK_SET) == -1) {
+    int status = load_superblock(new_fd, &new_sb);
+    if (status == 0 && journal_recover(new_fd, &new_sb) > 0) {
+        // A crash left a committed transaction in the journal, and replaying it rewrote the metadata: load it again
+        free_superblock(&new_sb);
+        status = load_superblock(new_fd, &new_sb);
+    }
+    if (status == -1) {
         close(new_fd);
         return;
     }
-    if (read(new_fd, block_data, 1024) != 1024) {
+    if (status == -2) {
         close(new_fd);
+        fprintf(ctx->err, "Error: File system in %s has an invalid superblock\n", new_disk_name);
         return;
     }
-    memcpy(&new_sb, block_data, sizeof(Superblock));
-    int error_code = check_consistency(&new_sb, new_disk_name); // Perform consistency checks
+    int error_code = check_consistency(ctx, &new_sb, new_disk_name); // Perform consistency checks
     if (error_code != 0) {
+        free_superblock(&new_sb);
+        close(new_fd);
+        fprintf(ctx->err, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, error_code);
+        return;
+    }
+    bool *new_metadata_dirty = calloc(new_sb.data_start, sizeof(bool));
+    if (!new_metadata_dirty) {
+        free_superblock(&new_sb);
         close(new_fd);
-        fprintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, error_code);
         return;
     }
-    // New disk is valid, switch to it
-    if (is_mounted) {
-        close_disk();
+    // New disk is valid, switch to it (closing the old disk writes back its cached blocks)
+    attach_disk(ctx, new_fd, new_sb.block_size, new_sb.num_blocks); // Update the context's disk file descriptor
+    free_superblock(&ctx->volume->superblock);
+    ctx->volume->superblock = new_sb; // New superblock becomes the context's superblock
+    free(ctx->volume->metadata_dirty);
+    ctx->volume->metadata_dirty = new_metadata_dirty;
+    ctx->volume->superblock_dirty = false;
+    reserve_buffer(ctx, ctx->volume->superblock.block_size);
+    rebuild_free_extents(ctx); // Summarize the free runs of the new disk for allocation
+    rebuild_zero_map(ctx); // Find the data blocks that are holes of the disk file
+    build_dir_index(ctx); // Index the directory tree of the new disk for name lookups and listings
+    snprintf(ctx->volume->current_disk_name, sizeof(ctx->volume->current_disk_name), "%s", new_disk_name); // Only used in messages
+    ctx->current_inode_index = ctx->volume->superblock.root;
+    ctx->volume->is_mounted = true;
+}
+
+// Runs mount_disk with the metadata lock held exclusive
+void fs_mount(FsContext *ctx, char *new_disk_name) {
+    if (ctx->volume != &ctx->own_volume) {
+        fprintf(ctx->err, "Error: Cannot mount %s while sharing disk %s\n", new_disk_name, ctx->volume->current_disk_name);
+        return;
+    }
+    lock_metadata(ctx, true);
+    mount_disk(ctx, new_disk_name);
+    unlock_metadata(ctx);
+}
+
+// Returns the run of an extent list that holds block block_num of the file
+static uint32_t find_extent(const ExtentList *list, int block_num) {
+    // Binary search for the last run that starts at or before block_num
+    uint32_t low = 0;
+    uint32_t high = list->count;
+    while (high - low > 1) {
+        uint32_t middle = (low + high) / 2;
+        if (list->runs[middle].logical <= (uint32_t)block_num) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Writes the extent list of a file to its extent block
+static void write_extent_block(FsContext *ctx, int inode_index) {
+    ExtentList *list = &ctx->volume->superblock.extents[inode_index];
+    uint8_t *block_data = calloc(1, ctx->volume->superblock.block_size);
+    if (!block_data) {
+        return;
+    }
+    memcpy(block_data, &list->count, sizeof(uint32_t));
+    for (uint32_t k = 0; k < list->count; k++) {
+        memcpy(block_data + sizeof(uint32_t) + k * 2 * sizeof(uint32_t), &list->runs[k].start, sizeof(uint32_t));
+        memcpy(block_data + 2 * sizeof(uint32_t) + k * 2 * sizeof(uint32_t), &list->runs[k].count, sizeof(uint32_t));
+    }
+    write_block(ctx, ctx->volume->superblock.inode[inode_index].start_block, block_data);
+    free(block_data);
+}
+
+// Orders free runs largest first (lowest start on ties)
+static int compare_extents_by_size(const void *a, const void *b) {
+    const Extent *x = a;
+    const Extent *y = b;
+    if (x->size != y->size) {
+        return y->size - x->size;
     }
-    disk_fd = new_fd; // Update global disk file descriptor
-    memcpy(&superblock, &new_sb, sizeof(Superblock)); // Copy new superblock to global superblock
-    strcpy(current_disk_name, new_disk_name);
-    current_inode_index = 127;
-    is_mounted = true;
+    return x->start - y->start;
 }
 
-// Creates a new file or directory in the current working directory with the given name and the given number of blocks, and stores the attributes in the first available inode
-void fs_create(char name[5], int size) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Builds the blocks of a new file from free runs, largest first, plus a block for its extent list; returns -1 if the free space cannot hold it
+static int allocate_extents(FsContext *ctx, int inode_index, int size) {
+    if (ctx->volume->superblock.version != 2) {
+        return -1; // Version 1 inodes have no room for the extent flag
+    }
+    Extent *candidates = malloc(ctx->volume->disk.free_extents.count * sizeof(Extent));
+    if (!candidates) {
+        return -1;
+    }
+    memcpy(candidates, ctx->volume->disk.free_extents.runs, ctx->volume->disk.free_extents.count * sizeof(Extent));
+    qsort(candidates, ctx->volume->disk.free_extents.count, sizeof(Extent), compare_extents_by_size);
+    // Use the fewest runs that cover the file, and require one more free block for the extent list itself
+    uint32_t run_count = 0;
+    int covered = 0;
+    int free_total = 0;
+    for (int k = 0; k < ctx->volume->disk.free_extents.count; k++) {
+        if (covered < size) {
+            run_count++;
+            covered += candidates[k].size;
+        }
+        free_total += candidates[k].size;
+    }
+    FileExtent *runs = run_count <= max_extents(&ctx->volume->superblock) && free_total > size ? malloc(run_count * sizeof(FileExtent)) : NULL;
+    if (!runs) {
+        free(candidates);
+        return -1;
+    }
+    int logical = 0;
+    for (uint32_t k = 0; k < run_count; k++) {
+        int count = size - logical < candidates[k].size ? size - logical : candidates[k].size;
+        runs[k].logical = logical;
+        runs[k].start = candidates[k].start;
+        runs[k].count = count;
+        update_free_blocks(ctx, candidates[k].start, count, true);
+        logical += count;
+    }
+    free(candidates);
+    int extent_block = find_contiguous_blocks(ctx, 1);
+    update_free_blocks(ctx, extent_block, 1, true);
+    ctx->volume->superblock.inode[inode_index].start_block = extent_block;
+    ctx->volume->superblock.inode[inode_index].flags = INODE_EXTENTS;
+    ctx->volume->superblock.extents[inode_index].count = run_count;
+    ctx->volume->superblock.extents[inode_index].runs = runs;
+    write_extent_block(ctx, inode_index);
+    return 0;
+}
+
+// Frees the data blocks of a file (and its extent block, if it is extent-mapped) and queues them to be zeroed by zero_deferred_blocks
+void release_file_blocks(FsContext *ctx, int inode_index) {
+    Inode *inode = &ctx->volume->superblock.inode[inode_index];
+    FileExtent single;
+    const FileExtent *runs;
+    uint32_t run_count = file_runs(&ctx->volume->superblock, inode_index, &single, &runs);
+    for (uint32_t k = 0; k < run_count; k++) {
+        // Only free blocks if the run actually has allocated blocks
+        if (runs[k].start > 0 && runs[k].count > 0) {
+            update_free_blocks(ctx, runs[k].start, runs[k].count, false);
+            defer_zero_blocks(ctx, runs[k].start, runs[k].count); // Zero out data blocks
+        }
+    }
+    if (inode->flags & INODE_EXTENTS) {
+        update_free_blocks(ctx, inode->start_block, 1, false);
+        defer_zero_blocks(ctx, inode->start_block, 1);
+        free(ctx->volume->superblock.extents[inode_index].runs);
+        ctx->volume->superblock.extents[inode_index].runs = NULL;
+        ctx->volume->superblock.extents[inode_index].count = 0;
+        inode->flags = 0;
+    }
+}
+
+// Resolves the directory part of the running command's path one component at a time through the directory index,
+// starting from the root for an absolute path and from the current directory otherwise; returns the directory's inode
+// index, or -1 after reporting the first component that is not a directory
+static int resolve_path_directory(FsContext *ctx) {
+    const char *path = ctx->path_directory;
+    int length = ctx->path_directory_length;
+    int dir = ctx->current_inode_index;
+    int pos = 0;
+    if (length > 0 && path[0] == '/') {
+        dir = ctx->volume->superblock.root;
+        pos = 1;
+    }
+    while (pos < length) {
+        int end = pos;
+        while (end < length && path[end] != '/') {
+            end++;
+        }
+        char name[5] = {0};
+        memcpy(name, path + pos, end - pos < 5 ? end - pos : 5); // The command processor limits components to 5 characters
+        if (end - pos == 2 && name[0] == '.' && name[1] == '.') {
+            if (dir != (int)ctx->volume->superblock.root) {
+                dir = ctx->volume->superblock.inode[dir].isdir_parent & INODE_FIELD_MASK;
+            }
+        } else if (end - pos != 1 || name[0] != '.') {
+            Inode *inode = find_inode_by_name(ctx, name, dir);
+            if (!inode || !(inode->isdir_parent & INODE_DIR)) {
+                fprintf(ctx->err, "Error: Directory %.5s does not exist\n", name);
+                return -1;
+            }
+            dir = inode - ctx->volume->superblock.inode;
+        }
+        pos = end + 1;
+    }
+    return dir;
+}
+
+// Creates a new file or directory in the command's directory (the current one for a bare name) with the given name and the given number of blocks, and stores the attributes in the first available inode
+static void create_entry(FsContext *ctx, char name[5], int size) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return;
+    }
+    int dir = resolve_path_directory(ctx);
+    if (dir == -1) {
         return;
     }
-    int inode_index = find_free_inode(); // Find free inode
+    int inode_index = find_free_inode(ctx); // Find free inode
     if (inode_index == -1) {
-        fprintf(stderr, "Error: Superblock in disk %s is full, cannot create %.5s\n", current_disk_name, name);
+        fprintf(ctx->err, "Error: Superblock in disk %s is full, cannot create %.5s\n", ctx->volume->current_disk_name, name);
         return;
     }
     // Check if name is reserved or not unique
-    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || !is_name_unique_in_directory(current_inode_index, name)) {
-        fprintf(stderr, "Error: File or directory %.5s already exists\n", name);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || !is_name_unique_in_directory(ctx, dir, name)) {
+        fprintf(ctx->err, "Error: File or directory %.5s already exists\n", name);
         return;
     }
     int actual_size = size;
     if (size == 0) {
         // Directory
-        superblock.inode[inode_index].isdir_parent = 0x80 | (current_inode_index == 127 ? 127 : current_inode_index);
-        superblock.inode[inode_index].start_block = 0;
+        ctx->volume->superblock.inode[inode_index].isdir_parent = INODE_DIR | dir;
+        ctx->volume->superblock.inode[inode_index].start_block = 0;
     } else {
-        int start_block = find_contiguous_blocks(size); // File: find contiguous blocks
-        if (start_block == -1) {
-            fprintf(stderr, "Error: Cannot allocate %d blocks on %s\n", size, current_disk_name);
+        int start_block = find_contiguous_blocks(ctx, size); // File: find contiguous blocks
+        if (start_block != -1) {
+            ctx->volume->superblock.inode[inode_index].start_block = start_block;
+            update_free_blocks(ctx, start_block, size, true);
+        } else if (allocate_extents(ctx, inode_index, size) == -1) {
+            // No single run is large enough, and the free runs cannot hold the file as an extent list either
+            fprintf(ctx->err, "Error: Cannot allocate %d blocks on %s\n", size, ctx->volume->current_disk_name);
             return;
         }
-        superblock.inode[inode_index].start_block = start_block;
-        uint8_t parent = (current_inode_index == 127 ? 127 : current_inode_index);
-        superblock.inode[inode_index].isdir_parent = parent; // MSB 0 for files
-        update_free_blocks(start_block, size, true);
+        ctx->volume->superblock.inode[inode_index].isdir_parent = dir; // MSB 0 for files
     }
-    memcpy(superblock.inode[inode_index].name, name, 5); // Set inode fields
-    superblock.inode[inode_index].isused_size = 0x80 | (actual_size & 0x7F);
-    write_block(0, (uint8_t*)&superblock); // Write updated superblock back to disk
+    memcpy(ctx->volume->superblock.inode[inode_index].name, name, 5); // Set inode fields
+    ctx->volume->superblock.inode[inode_index].isused_size = INODE_USED | (actual_size & INODE_FIELD_MASK);
+    index_add(ctx, inode_index); // Make the new entry visible to lookups
+    mark_inode_dirty(ctx, inode_index);
+    mark_superblock_dirty(ctx); // Updated superblock is written back at the next sync point
 }
 
-// Deletes the file or directory with the given name in the current working directory
-void fs_delete(char name[5]) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Runs create_entry with the metadata lock held exclusive
+void fs_create(FsContext *ctx, char name[5], int size) {
+    lock_metadata(ctx, true);
+    create_entry(ctx, name, size);
+    unlock_metadata(ctx);
+}
+
+// Deletes the file or directory with the given name in the command's directory
+static void delete_entry(FsContext *ctx, char name[5]) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
-    Inode *inode = find_inode_by_name(name, current_inode_index); // Find the inode by name in current directory
-    if (!inode) {
-        fprintf(stderr, "Error: File or directory %.5s does not exist\n", name);
+    int dir = resolve_path_directory(ctx);
+    if (dir == -1) {
         return;
     }
-    int inode_index = -1;
-    // Find index of the inode in superblock array
-    for (int i = 0; i < 126; i++) {
-        if (&superblock.inode[i] == inode) {
-            inode_index = i;
-            break;
-        }
+    Inode *inode = find_inode_by_name(ctx, name, dir); // Find the inode by name in that directory
+    if (!inode) {
+        fprintf(ctx->err, "Error: File or directory %.5s does not exist\n", name);
+        return;
     }
+    int inode_index = inode - ctx->volume->superblock.inode; // Index of the inode in superblock array
     // Perform recursive deletion (handles both files and directories)
-    if (inode_index != -1) {
-        recursive_delete(inode_index);
-        write_block(0, (uint8_t*)&superblock); // Persist changes
+    recursive_delete(ctx, inode_index);
+    zero_deferred_blocks(ctx); // Zero everything the delete freed, one write or hole punch per contiguous range
+    mark_superblock_dirty(ctx); // Persist changes at the next sync point
+}
+
+// Runs delete_entry with the metadata lock held exclusive
+void fs_delete(FsContext *ctx, char name[5]) {
+    lock_metadata(ctx, true);
+    delete_entry(ctx, name);
+    unlock_metadata(ctx);
+}
+
+// Looks up a regular file in the command's directory and checks that blocks [start, start + count) exist; returns its inode index or -1
+static int find_file_range(FsContext *ctx, char name[5], int start, int count) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return -1;
     }
+    int dir = resolve_path_directory(ctx);
+    if (dir == -1) {
+        return -1;
+    }
+    Inode *inode = find_inode_by_name(ctx, name, dir);
+    // Find file inode (must be regular file, not directory)
+    if (!inode || (inode->isdir_parent & INODE_DIR)) {
+        fprintf(ctx->err, "Error: File %.5s does not exist\n", name);
+        return -1;
+    }
+    int size = inode->isused_size & INODE_FIELD_MASK;
+    // Validate block numbers are within file bounds, reporting the first missing block
+    if (start < 0 || count < 1 || start >= size || count > size - start) {
+        fprintf(ctx->err, "Error: %.5s does not have block %d\n", name, start < size ? size : start);
+        return -1;
+    }
+    return inode - ctx->volume->superblock.inode;
 }
 
-// Opens the file with the given name and reads the block num-th block of the file into the buffer
-void fs_read(char name[5], int block_num) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Selects the largest read-ahead window in blocks, 0 to turn read-ahead off; returns -1 for a value that is not a count
+int set_read_ahead(const char *blocks) {
+    char *end;
+    long value = strtol(blocks, &end, 10);
+    if (*blocks == '\0' || *end != '\0' || value < 0 || value > INT_MAX) {
+        return -1;
+    }
+    read_ahead_blocks = value;
+    return 0;
+}
+
+// Returns the read stream of a file, taking over the least recently used one when the file has none
+static ReadStream *read_stream(FsContext *ctx, int inode_index) {
+    ReadStream *victim = &ctx->read_streams[0];
+    for (int i = 0; i < READ_STREAMS; i++) {
+        if (ctx->read_streams[i].inode_index == inode_index) {
+            return &ctx->read_streams[i];
+        }
+        if (ctx->read_streams[i].last_use < victim->last_use) {
+            victim = &ctx->read_streams[i];
+        }
+    }
+    ctx->read_ahead_stats.wasted += victim->window_count - victim->window_used;
+    victim->inode_index = inode_index;
+    victim->next_block = -1;
+    victim->sequential_reads = 0;
+    victim->window_size = READ_AHEAD_MIN_BLOCKS;
+    victim->window_count = 0;
+    victim->window_used = 0;
+    return victim;
+}
+
+// Reads block `block` of a file, at disk block disk_block with run_left blocks of its contiguous run from there on, into
+// data. The third of three single-block reads of consecutive blocks of a file starts a stream: the following blocks of
+// the run are read with it in one window, and reads of them are served from memory until the reader leaves the window. The
+// caller holds the metadata lock and the file's data lock shared, so a window cannot go stale while it is used;
+// between commands, any exclusive lock of the metadata or of the file's data lock makes it stale.
+static void read_file_block(FsContext *ctx, int inode_index, int block, int disk_block, int run_left, uint8_t *data) {
+    size_t block_size = ctx->volume->superblock.block_size;
+    size_t window_limit = READ_AHEAD_MAX_BYTES / block_size; // Largest window the byte bound allows
+    if (window_limit > (size_t)read_ahead_blocks) {
+        window_limit = read_ahead_blocks; // set_read_ahead never stores a negative count
+    }
+    int max_blocks = (int)window_limit;
+    if (max_blocks < 2 || ctx->volume->disk.map) {
+        read_block(ctx, disk_block, data); // A mapped disk is already read straight from memory
         return;
     }
-    Inode *inode = find_inode_by_name(name, current_inode_index);
-    // Find file inode (must be regular file, not directory)
-    if (!inode || (inode->isdir_parent & 0x80)) {
-        fprintf(stderr, "Error: File %.5s does not exist\n", name);
+    long long started_ns = stats_enabled ? monotonic_ns() : 0;
+    ReadAheadStats *stats = &ctx->read_ahead_stats;
+    ReadStream *stream = read_stream(ctx, inode_index);
+    stream->last_use = ++ctx->read_clock;
+    unsigned long generation = ctx->volume->metadata_generation + ctx->volume->data_generation[inode_index % FILE_LOCK_STRIPES];
+    if (stream->window_count > 0 && stream->generation != generation) {
+        stats->wasted += stream->window_count - stream->window_used; // Written or moved since it was read
+        stream->window_count = 0;
+        stream->window_used = 0;
+    }
+    stream->sequential_reads = block == stream->next_block ? stream->sequential_reads + 1 : 0;
+    bool sequential = stream->sequential_reads >= READ_AHEAD_TRIGGER;
+    stream->next_block = block + 1;
+    if (block >= stream->window_first && block < stream->window_first + stream->window_count) {
+        memcpy(data, stream->window + (size_t)(block - stream->window_first) * block_size, block_size);
+        stream->window_used++;
+        stats->hits++;
+        if (stats_enabled) {
+            stats->window_ns += monotonic_ns() - started_ns;
+        }
         return;
     }
-    int size = inode->isused_size & 0x7F;
-    // Validate block number is within file bounds
-    if (block_num < 0 || block_num >= size) {
-        fprintf(stderr, "Error: %.5s does not have block %d\n", name, block_num);
+    if (sequential && run_left > 1 && stream->window_capacity < (size_t)max_blocks * block_size) {
+        uint8_t *window = realloc(stream->window, (size_t)max_blocks * block_size);
+        if (window) {
+            stream->window = window;
+            stream->window_capacity = (size_t)max_blocks * block_size;
+        }
+    }
+    if (!sequential || run_left < 2 || stream->window_capacity < (size_t)max_blocks * block_size) {
+        read_block(ctx, disk_block, data);
+        stats->direct_reads++;
+        if (stats_enabled) {
+            stats->direct_ns += monotonic_ns() - started_ns;
+        }
         return;
     }
-    int block_to_read = inode->start_block + block_num; // Calculate physical block
-    read_block(block_to_read, buffer); // Read into global buffer
+    // The reader left the previous window: grow the next one if it used all of it, shrink it if it used less than half
+    if (stream->window_count > 0) {
+        if (stream->window_used == stream->window_count) {
+            stream->window_size = stream->window_size * 2 < max_blocks ? stream->window_size * 2 : max_blocks;
+        } else if (stream->window_used * 2 < stream->window_count) {
+            stream->window_size = stream->window_size / 2 > READ_AHEAD_MIN_BLOCKS ? stream->window_size / 2 : READ_AHEAD_MIN_BLOCKS;
+        }
+        stats->wasted += stream->window_count - stream->window_used;
+    }
+    int count = stream->window_size < run_left ? stream->window_size : run_left;
+    count = count < max_blocks ? count : max_blocks;
+    read_blocks(ctx, disk_block, count, stream->window);
+    if (ctx->corrupt_block == disk_block) {
+        count = 1; // The block asked for is corrupted (the caller reports it); the rest is checked again when read
+    } else if (ctx->corrupt_block > disk_block) {
+        count = ctx->corrupt_block - disk_block; // End the window before a corrupted block, reported when it is read
+        ctx->corrupt_block = -1;
+    }
+    memcpy(data, stream->window, block_size);
+    stream->window_first = block;
+    stream->window_count = count;
+    stream->window_used = 1;
+    stream->generation = generation;
+    stats->windows++;
+    stats->blocks_ahead += count - 1;
+    if (stats_enabled) {
+        stats->window_ns += monotonic_ns() - started_ns;
+    }
 }
 
-// Opens the file with the given name and writes the content of the buffer to the block num-th block of the file
-void fs_write(char name[5], int block_num) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Moves blocks [start, start + count) of a file between the disk and the buffer, one read or write per contiguous disk run
+static void transfer_range(FsContext *ctx, int inode_index, int start, int count, bool to_disk) {
+    if (!reserve_buffer(ctx, (size_t)count * ctx->volume->superblock.block_size)) {
+        fprintf(ctx->err, "Error: Buffer cannot hold %d blocks\n", count);
         return;
     }
-    Inode *inode = find_inode_by_name(name, current_inode_index);
-    // Find file inode (must be regular file, not directory)
-    if (!inode || (inode->isdir_parent & 0x80)) {
-        fprintf(stderr, "Error: File %.5s does not exist\n", name);
-        return;
+    FileExtent single;
+    const FileExtent *runs;
+    uint32_t run_count = file_runs(&ctx->volume->superblock, inode_index, &single, &runs);
+    // Contiguous files have a single run; extent-mapped files start from a binary search of their list
+    uint32_t first_run = ctx->volume->superblock.inode[inode_index].flags & INODE_EXTENTS ? find_extent(&ctx->volume->superblock.extents[inode_index], start) : 0;
+    for (uint32_t k = first_run; k < run_count && runs[k].logical < (uint32_t)(start + count); k++) {
+        // Part of the run that overlaps the range
+        int first = runs[k].logical > (uint32_t)start ? (int)runs[k].logical : start;
+        int last = runs[k].logical + runs[k].count < (uint32_t)(start + count) ? (int)(runs[k].logical + runs[k].count) : start + count;
+        if (first >= last) {
+            continue;
+        }
+        int disk_block = runs[k].start + (first - runs[k].logical);
+        uint8_t *data = ctx->buffer + (size_t)(first - start) * ctx->volume->superblock.block_size;
+        ctx->corrupt_block = -1;
+        if (last - first == 1) {
+            // A single block goes through the block cache
+            if (to_disk) {
+                write_block(ctx, disk_block, data);
+            } else {
+                read_file_block(ctx, inode_index, first, disk_block, runs[k].logical + runs[k].count - first, data);
+            }
+        } else if (to_disk) {
+            write_blocks(ctx, disk_block, last - first, data);
+        } else {
+            read_blocks(ctx, disk_block, last - first, data);
+        }
+        if (ctx->corrupt_block != -1) {
+            fprintf(ctx->err, "Error: Block %d of %.5s is corrupted\n", first + (ctx->corrupt_block - disk_block),
+                    ctx->volume->superblock.inode[inode_index].name);
+        }
     }
-    int size = inode->isused_size & 0x7F;
-    // Validate block number is within file bounds
-    if (block_num < 0 || block_num >= size) {
-        fprintf(stderr, "Error: %.5s does not have block %d\n", name, block_num);
-        return;
+}
+
+// Opens the file with the given name and reads the block num-th block of the file into the buffer
+void fs_read(FsContext *ctx, char name[5], int block_num) {
+    fs_read_range(ctx, name, block_num, 1);
+}
+
+// Opens the file with the given name and writes the content of the buffer to the block num-th block of the file
+void fs_write(FsContext *ctx, char name[5], int block_num) {
+    fs_write_range(ctx, name, block_num, 1);
+}
+
+// Looks up a file and moves a range of it, holding the metadata lock shared and the file's data lock shared for a
+// read or exclusive for a write, so reads of any files and writes of other files can run at the same time
+static void transfer_file_range(FsContext *ctx, char name[5], int start, int count, bool to_disk) {
+    lock_metadata(ctx, false);
+    int inode_index = find_file_range(ctx, name, start, count);
+    if (inode_index != -1) {
+        pthread_rwlock_t *data_lock = &ctx->volume->file_locks[inode_index % FILE_LOCK_STRIPES];
+        if (to_disk) {
+            pthread_rwlock_wrlock(data_lock);
+            ctx->volume->data_generation[inode_index % FILE_LOCK_STRIPES]++; // Read-ahead windows of these files are stale
+        } else {
+            pthread_rwlock_rdlock(data_lock);
+        }
+        transfer_range(ctx, inode_index, start, count, to_disk);
+        pthread_rwlock_unlock(data_lock);
     }
-    int block_to_write = inode->start_block + block_num; // Calculate physical block
-    write_block(block_to_write, buffer); // Write into global buffer
+    unlock_metadata(ctx);
+}
+
+// Reads blocks [start, start + count) of the file with the given name into consecutive blocks of the buffer
+void fs_read_range(FsContext *ctx, char name[5], int start, int count) {
+    transfer_file_range(ctx, name, start, count, false);
 }
 
-// Flushes the buffer by zeroing it and writes the new bytes into the buffer
-void fs_buff(uint8_t buff[1024]) {
-	if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Writes consecutive blocks of the buffer to blocks [start, start + count) of the file with the given name
+void fs_write_range(FsContext *ctx, char name[5], int start, int count) {
+    transfer_file_range(ctx, name, start, count, true);
+}
+
+// Flushes the buffer by zeroing it and writes the new bytes (at most one block) into the buffer
+void fs_buff(FsContext *ctx, const uint8_t *buff, int length) {
+    lock_metadata(ctx, false);
+    bool mounted = ctx->volume->is_mounted;
+    unlock_metadata(ctx);
+    if (!mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
-    memset(buffer, 0, 1024); // Clear buffer
-    memcpy(buffer, buff, 1024); // Copy new data
+    memset(ctx->buffer, 0, ctx->buffer_size); // Clear buffer
+    memcpy(ctx->buffer, buff, (size_t)length < ctx->buffer_size ? (size_t)length : ctx->buffer_size); // Copy new data
+}
+
+// Orders inode indices ascending
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
 }
 
 // Lists all files and directories that exist in the current directory, including the special directories . and ..
-void fs_ls(void) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+static void list_directory(FsContext *ctx) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
     int parent_index; // Calculate parent directory index
-    if (current_inode_index == 127) {
-        parent_index = 127;
+    if (ctx->current_inode_index == (int)ctx->volume->superblock.root) {
+        parent_index = ctx->volume->superblock.root;
     } else {
-        parent_index = superblock.inode[current_inode_index].isdir_parent & 0x7F;
+        parent_index = ctx->volume->superblock.inode[ctx->current_inode_index].isdir_parent & INODE_FIELD_MASK;
     }
     // Print special entries
-    printf("%-5s %3d\n", ".", count_children(current_inode_index));
-    printf("%-5s %3d\n", "..", count_children(parent_index));
-    // List all entries in current directory
-    for (int i = 0; i < 126; i++) {
-        if (superblock.inode[i].isused_size & 0x80) {
-            int file_parent = superblock.inode[i].isdir_parent & 0x7F;
-            if (file_parent == current_inode_index) {
-                if (superblock.inode[i].isdir_parent & 0x80) {
-                    printf("%-5.5s %3d\n", superblock.inode[i].name, count_children(i));
-                } else {
-                    int size = superblock.inode[i].isused_size & 0x7F;
-                    printf("%-5.5s %3d KB\n", superblock.inode[i].name, size);
-                }
-            }
+    fprintf(ctx->out, "%-5s %3d\n", ".", count_children(ctx, ctx->current_inode_index));
+    fprintf(ctx->out, "%-5s %3d\n", "..", count_children(ctx, parent_index));
+    // List all entries in current directory, in inode order
+    int *children = malloc((count_children(ctx, ctx->current_inode_index) - 2 + 1) * sizeof(int));
+    if (!children) {
+        return;
+    }
+    int child_count = 0;
+    for (int i = first_child_of(ctx, ctx->current_inode_index); i != -1; i = next_child(ctx, i)) {
+        children[child_count++] = i;
+    }
+    qsort(children, child_count, sizeof(int), compare_ints);
+    for (int c = 0; c < child_count; c++) {
+        int i = children[c];
+        if (ctx->volume->superblock.inode[i].isdir_parent & INODE_DIR) {
+            fprintf(ctx->out, "%-5.5s %3d\n", ctx->volume->superblock.inode[i].name, count_children(ctx, i));
+        } else {
+            uint64_t size = ctx->volume->superblock.inode[i].isused_size & INODE_FIELD_MASK;
+            int size_kb = (size * ctx->volume->superblock.block_size + 1023) / 1024; // Blocks are 1 KB on a version 1 disk
+            fprintf(ctx->out, "%-5.5s %3d KB\n", ctx->volume->superblock.inode[i].name, size_kb);
         }
     }
+    free(children);
 }
 
-// Re-organizes the data blocks such that there is no free block between the used blocks, and between the superblock and the used blocks
-void fs_defrag(void) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
+// Runs list_directory with the metadata lock held shared
+void fs_ls(FsContext *ctx) {
+    lock_metadata(ctx, false);
+    list_directory(ctx);
+    unlock_metadata(ctx);
+}
+
+// Largest number of bytes moved by one read/write pair when defragmenting
+#define MOVE_CHUNK_BYTES (1024 * 1024)
+
+#define EXTENT_BLOCK_PIECE -1 // FileEntry.extent: the piece is the extent block of an extent-mapped file
+#define WHOLE_FILE_PIECE -2 // FileEntry.extent: the piece is a whole contiguous file
+
+// A piece of data that moves as one unit when defragmenting: a contiguous file, or one run or the extent block of an extent-mapped file
+typedef struct {
+    int inode_index; // Index in inode table
+    int extent; // Run index in the file's extent list, or EXTENT_BLOCK_PIECE or WHOLE_FILE_PIECE
+    int start_block; // Current physical start block
+    int size; // Size in blocks
+} FileEntry;
+
+// Orders pieces by current location (inode index on ties, matching a stable sort)
+static int compare_file_entries(const void *a, const void *b) {
+    const FileEntry *x = a;
+    const FileEntry *y = b;
+    if (x->start_block != y->start_block) {
+        return x->start_block < y->start_block ? -1 : 1;
+    }
+    return x->inode_index - y->inode_index;
+}
+
+// Gathers the pieces of all regular files (not directories) sorted by current location; returns the number of pieces (-1 if out of memory)
+static int gather_files_by_location(FsContext *ctx, FileEntry **files) {
+    size_t piece_limit = ctx->volume->superblock.num_inodes + 1;
+    uint32_t words = (ctx->volume->superblock.num_inodes + 63) / 64;
+    for (uint32_t word = 0; word < words; word++) {
+        // Only the files of the table, 64 inodes per word of the bitsets
+        for (uint64_t bits = file_inode_bits(ctx, word); bits != 0; bits &= bits - 1) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            piece_limit += ctx->volume->superblock.extents[i].count; // Extent-mapped files add their runs next to their extent block
+        }
+    }
+    *files = malloc(piece_limit * sizeof(FileEntry));
+    if (!*files) {
+        return -1;
     }
-    typedef struct {
-        int inode_index; // Index in inode table
-        int start_block; // Current physical start block
-        int size; // Size in blocks
-    } FileEntry;
-    FileEntry files[126];
     int file_count = 0;
-    // Gather all regular files (not directories)
-    for (int i = 0; i < 126; i++) {
-        if (superblock.inode[i].isused_size & 0x80 && !(superblock.inode[i].isdir_parent & 0x80)) {
-            files[file_count].inode_index = i;
-            files[file_count].start_block = superblock.inode[i].start_block;
-            files[file_count].size = superblock.inode[i].isused_size & 0x7F;
+    for (uint32_t word = 0; word < words; word++) {
+        for (uint64_t bits = file_inode_bits(ctx, word); bits != 0; bits &= bits - 1) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            bool extent_mapped = ctx->volume->superblock.inode[i].flags & INODE_EXTENTS;
+            (*files)[file_count].inode_index = i;
+            (*files)[file_count].extent = extent_mapped ? EXTENT_BLOCK_PIECE : WHOLE_FILE_PIECE;
+            (*files)[file_count].start_block = ctx->volume->superblock.inode[i].start_block;
+            (*files)[file_count].size = extent_mapped ? 1 : ctx->volume->superblock.inode[i].isused_size & INODE_FIELD_MASK;
             file_count++;
+            for (uint32_t k = 0; extent_mapped && k < ctx->volume->superblock.extents[i].count; k++) {
+                (*files)[file_count].inode_index = i;
+                (*files)[file_count].extent = k;
+                (*files)[file_count].start_block = ctx->volume->superblock.extents[i].runs[k].start;
+                (*files)[file_count].size = ctx->volume->superblock.extents[i].runs[k].count;
+                file_count++;
+            }
         }
     }
-    // Sort files by current location
-    for (int i = 0; i < file_count - 1; i++) {
-        for (int j = 0; j < file_count - i - 1; j++) {
-            if (files[j].start_block > files[j + 1].start_block) {
-                FileEntry temp = files[j];
-                files[j] = files[j + 1];
-                files[j + 1] = temp;
+    qsort(*files, file_count, sizeof(FileEntry), compare_file_entries); // Sort pieces by current location
+    return file_count;
+}
+
+// Number of blocks moved by one read/write pair when defragmenting
+static int move_run_blocks(FsContext *ctx) {
+    int run_blocks = MOVE_CHUNK_BYTES / ctx->volume->superblock.block_size;
+    return run_blocks < 1 ? 1 : run_blocks;
+}
+
+// Buffers of one defragmentation
+typedef struct {
+    uint8_t *run;   // Holds file data between its read and its write
+    int run_blocks; // Blocks run holds
+    uint32_t *checksums; // Checksums of the blocks in run, as they were at their old location
+    bool *vacated;  // Old blocks of moved pieces that no piece has been written over yet, zeroed when the moves end
+    bool *released; // Blocks freed since the last commit, which the metadata on the disk still gives to a file (disks
+                    // with a journal only, NULL otherwise)
+} DefragMoves;
+
+static void end_moves(DefragMoves *moves) {
+    free(moves->run);
+    free(moves->checksums);
+    free(moves->vacated);
+    free(moves->released);
+}
+
+// Allocates the buffers of a defragmentation; returns false if out of memory. On a disk with a journal the changes of
+// earlier commands are committed first, so the metadata on the disk describes the layout the moves start from.
+static bool start_moves(FsContext *ctx, DefragMoves *moves) {
+    uint32_t num_blocks = ctx->volume->superblock.num_blocks;
+    bool journaled = ctx->volume->superblock.journal_start != 0;
+    moves->run_blocks = move_run_blocks(ctx);
+    moves->run = malloc((size_t)moves->run_blocks * ctx->volume->superblock.block_size);
+    moves->checksums = malloc(moves->run_blocks * sizeof(uint32_t));
+    moves->vacated = calloc(num_blocks, sizeof(bool));
+    moves->released = journaled ? calloc(num_blocks, sizeof(bool)) : NULL;
+    if (!moves->run || !moves->checksums || !moves->vacated || (journaled && !moves->released)) {
+        end_moves(moves);
+        return false;
+    }
+    if (journaled) {
+        sync_superblock(ctx);
+    }
+    return true;
+}
+
+// Commits the metadata of the moves so far on a disk with a journal, after which the blocks they freed are free on the
+// disk too and may be written over or zeroed
+static void commit_moves(FsContext *ctx, DefragMoves *moves) {
+    if (moves->released) {
+        sync_superblock(ctx);
+        memset(moves->released, 0, ctx->volume->superblock.num_blocks * sizeof(bool));
+    }
+}
+
+// Returns true if a block of [start, start + size) was freed since the last commit
+static bool any_released(const DefragMoves *moves, int start, int size) {
+    for (int block = start; moves->released && block < start + size; block++) {
+        if (moves->released[block]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies size blocks from old_start to new_start through the run buffer, with their checksums
+static void copy_blocks(FsContext *ctx, DefragMoves *moves, int old_start, int new_start, int size) {
+    // Copy front to back in runs: when the destination lies below the source, no unread block is overwritten
+    for (int offset = 0; offset < size; offset += moves->run_blocks) {
+        int count = size - offset < moves->run_blocks ? size - offset : moves->run_blocks;
+        read_blocks(ctx, old_start + offset, count, moves->run); // Read the whole run at once
+        // Taken before the write, which recomputes the checksums of a destination that can overlap the source
+        load_block_checksums(ctx, old_start + offset, count, moves->checksums);
+        write_blocks(ctx, new_start + offset, count, moves->run); // Write it to its new location at once
+        store_block_checksums(ctx, new_start + offset, count, moves->checksums);
+    }
+}
+
+// Moves a piece's data to new_start and updates its inode or extent list and the bitmap; its old blocks become vacated,
+// and released on a disk with a journal. An extent block is rewritten in place rather than journaled, so there the new
+// run is committed as allocated before the extent block points to it.
+static void move_file(FsContext *ctx, DefragMoves *moves, FileEntry *file, int new_start) {
+    int old_start = file->start_block;
+    copy_blocks(ctx, moves, old_start, new_start, file->size);
+    if (file->extent >= 0 && moves->released) {
+        update_free_blocks(ctx, new_start, file->size, true); // Never overlaps the old run with a journal (place_piece)
+        commit_moves(ctx, moves);
+        ctx->volume->superblock.extents[file->inode_index].runs[file->extent].start = new_start;
+        write_extent_block(ctx, file->inode_index);
+        update_free_blocks(ctx, old_start, file->size, false);
+    } else {
+        if (file->extent >= 0) {
+            ctx->volume->superblock.extents[file->inode_index].runs[file->extent].start = new_start; // Update the run with its new location
+            write_extent_block(ctx, file->inode_index);
+        } else {
+            ctx->volume->superblock.inode[file->inode_index].start_block = new_start; // Update inode with new location
+            mark_inode_dirty(ctx, file->inode_index);
+        }
+        update_free_blocks(ctx, old_start, file->size, false); // Free old blocks
+        update_free_blocks(ctx, new_start, file->size, true); // Allocate new blocks
+    }
+    for (int block = old_start; block < old_start + file->size; block++) {
+        moves->vacated[block] = true;
+        if (moves->released) {
+            moves->released[block] = true;
+        }
+    }
+    for (int block = new_start; block < new_start + file->size; block++) {
+        moves->vacated[block] = false; // Overwritten with live data, no need to zero it
+    }
+    file->start_block = new_start;
+}
+
+// Moves a piece down to new_start. On a disk with a journal a crash must find the data of the committed layout intact:
+// the moves are committed before a piece is written over blocks freed since the last commit, and a piece that would
+// slide over its own blocks first goes to a free run elsewhere. Returns the start the piece ends at, which is its old
+// start if no free run can hold it.
+static int place_piece(FsContext *ctx, DefragMoves *moves, FileEntry *file, int new_start) {
+    if (moves->released && new_start + file->size > file->start_block) {
+        commit_moves(ctx, moves);
+        int stage = find_contiguous_blocks(ctx, file->size); // Never meets the destination, the gap below is smaller
+        if (stage == -1) {
+            return file->start_block;
+        }
+        move_file(ctx, moves, file, stage);
+        commit_moves(ctx, moves);
+    } else if (any_released(moves, new_start, file->size)) {
+        commit_moves(ctx, moves);
+    }
+    move_file(ctx, moves, file, new_start);
+    return new_start;
+}
+
+// Zeroes the vacated blocks, one write per contiguous run (normally a single run at the tail), once the metadata that
+// freed them is committed on a disk with a journal
+static void zero_vacated_blocks(FsContext *ctx, DefragMoves *moves) {
+    commit_moves(ctx, moves);
+    int block = ctx->volume->superblock.data_start;
+    while (block < (int)ctx->volume->superblock.num_blocks) {
+        if (!moves->vacated[block]) {
+            block++;
+            continue;
+        }
+        int run_start = block;
+        while (block < (int)ctx->volume->superblock.num_blocks && moves->vacated[block]) {
+            moves->vacated[block++] = false;
+        }
+        zero_blocks(ctx, run_start, block - run_start);
+    }
+}
+
+// Rewrites the first extent-mapped file that fits in the free blocks from first_free on as a contiguous file there; returns its size, or 0 if none fits
+static int make_file_contiguous(FsContext *ctx, DefragMoves *moves, int first_free) {
+    int tail = ctx->volume->superblock.num_blocks - first_free;
+    uint32_t words = (ctx->volume->superblock.num_inodes + 63) / 64;
+    for (uint32_t word = 0; word < words; word++) {
+        for (uint64_t bits = file_inode_bits(ctx, word); bits != 0; bits &= bits - 1) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            int size = ctx->volume->superblock.inode[i].isused_size & INODE_FIELD_MASK;
+            if (!(ctx->volume->superblock.inode[i].flags & INODE_EXTENTS) || size > tail) {
+                continue;
             }
+            if (any_released(moves, first_free, size)) {
+                commit_moves(ctx, moves);
+            }
+            ExtentList *list = &ctx->volume->superblock.extents[i];
+            for (uint32_t k = 0; k < list->count; k++) {
+                copy_blocks(ctx, moves, list->runs[k].start, first_free + list->runs[k].logical, list->runs[k].count);
+            }
+            release_file_blocks(ctx, i); // Frees the runs and the extent block, and clears the flag
+            ctx->volume->superblock.inode[i].start_block = first_free;
+            mark_inode_dirty(ctx, i);
+            update_free_blocks(ctx, first_free, size, true);
+            commit_moves(ctx, moves); // The old runs are only zeroed once the inode no longer points to them
+            zero_deferred_blocks(ctx);
+            return size;
         }
     }
-    int next_free_block = 1; // Start after superblock (block 0)
-    for (int i = 0; i < file_count; i++) {
-        int old_start = files[i].start_block;
-        int new_start = next_free_block;
-        int file_size = files[i].size;
-        // Only move if file is not already in correct position
-        if (old_start != new_start) {
-            // Copy each block to new location
-            for (int block_offset = 0; block_offset < file_size; block_offset++) {
-                int old_block = old_start + block_offset;
-                int new_block = new_start + block_offset;
-                uint8_t block_data[1024];
-                read_block(old_block, block_data); // Read from old location
-                write_block(new_block, block_data); // Write to new location
-                uint8_t zero_block[1024] = {0}; // Zero out old block
-                write_block(old_block, zero_block);
+    return 0;
+}
+
+// Slides every piece down to the end of the previous one, zeroing the blocks left behind; every piece moves at most once,
+// except on a disk with a journal, where one may pass through a free run, and a piece no free run could hold is tried
+// again once the others have moved. Returns the first block after the packed data (the end of the disk if out of memory).
+static int compact_files(FsContext *ctx, DefragMoves *moves) {
+    int next_free_block;
+    bool moved;
+    bool stayed;
+    do {
+        FileEntry *files;
+        int file_count = gather_files_by_location(ctx, &files);
+        if (file_count == -1) {
+            return ctx->volume->superblock.num_blocks;
+        }
+        next_free_block = ctx->volume->superblock.data_start; // Start after the superblock (metadata blocks)
+        moved = false;
+        stayed = false;
+        for (int i = 0; i < file_count; i++) {
+            int start = files[i].start_block;
+            // Only move if file is not already in correct position
+            if (start != next_free_block) {
+                start = place_piece(ctx, moves, &files[i], next_free_block);
+                moved |= start == next_free_block;
+                stayed |= start != next_free_block;
             }
-            superblock.inode[files[i].inode_index].start_block = new_start; // Update inode with new location
-            update_free_blocks(old_start, file_size, false); // Free old blocks
-            update_free_blocks(new_start, file_size, true); // Allocate new blocks
+            next_free_block = start + files[i].size; // Move pointer for next file
         }
-        next_free_block += file_size; // Move pointer for next file
+        free(files);
+    } while (moved && stayed);
+    zero_vacated_blocks(ctx, moves);
+    return next_free_block;
+}
+
+// Re-organizes the data blocks such that there is no free block between the used blocks, and between the superblock and the used blocks
+static void defrag_all(FsContext *ctx) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return;
+    }
+    DefragMoves moves;
+    if (!start_moves(ctx, &moves)) {
+        return;
     }
-    write_block(0, (uint8_t*)&superblock); // Persist changes to disk
+    // Compact, then rewrite one extent-mapped file as a contiguous file in the free tail, until no such file fits
+    int packed_end;
+    do {
+        packed_end = compact_files(ctx, &moves);
+    } while (make_file_contiguous(ctx, &moves, packed_end) > 0);
+    end_moves(&moves);
+    // Only start blocks moved, so the directory index (parents and names) is still valid
+    mark_superblock_dirty(ctx); // Persist changes at the next sync point
 }
 
-// Changes the current working directory to a directory with the specified name in the current working directory
-void fs_cd(char name[5]) {
-    if (!is_mounted) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Runs defrag_all with the metadata lock held exclusive
+void fs_defrag(FsContext *ctx) {
+    lock_metadata(ctx, true);
+    defrag_all(ctx);
+    unlock_metadata(ctx);
+}
+
+// Moves at most max_blocks blocks of data toward the layout produced by fs_defrag, leaving the superblock consistent
+static void defrag_partial(FsContext *ctx, int max_blocks) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
-    // Current directory
-    if (strcmp(name, ".") == 0) {
+    // The compacted layout is recomputed from the current one, so progress resumes across calls, mounts and other commands
+    FileEntry *files;
+    DefragMoves moves;
+    int file_count = gather_files_by_location(ctx, &files);
+    if (file_count == -1 || !start_moves(ctx, &moves)) {
+        free(files);
         return;
-    // Parent directory
-    } else if (strcmp(name, "..") == 0) {
-        if (current_inode_index != 127) {
-            current_inode_index = superblock.inode[current_inode_index].isdir_parent & 0x7F;
+    }
+    int moved = 0;
+    int next_free_block = ctx->volume->superblock.data_start; // Start after the superblock (metadata blocks)
+    int i;
+    for (i = 0; i < file_count && moved < max_blocks; i++) {
+        int start = files[i].start_block;
+        int file_size = files[i].size;
+        if (start != next_free_block) {
+            // Files move whole; one larger than the budget is moved on its own so every call makes progress
+            if (moved > 0 && file_size > max_blocks - moved) {
+                break;
+            }
+            start = place_piece(ctx, &moves, &files[i], next_free_block);
+            moved += start == next_free_block ? file_size : 0;
         }
+        next_free_block = start + file_size; // Move pointer for next file
+    }
+    if (i == file_count && moved == 0) {
+        // Already compact: make the next extent-mapped file contiguous, as fs_defrag would
+        moved = make_file_contiguous(ctx, &moves, next_free_block);
+    }
+    free(files);
+    if (moved > 0) {
+        mark_superblock_dirty(ctx);
+        sync_superblock(ctx); // Every step ends with the disk's superblock describing the moved files
+    }
+    zero_vacated_blocks(ctx, &moves); // Zero the old blocks the new locations did not overwrite, as fs_defrag would
+    end_moves(&moves);
+}
+
+// Runs defrag_partial with the metadata lock held exclusive
+void fs_defrag_step(FsContext *ctx, int max_blocks) {
+    lock_metadata(ctx, true);
+    defrag_partial(ctx, max_blocks);
+    unlock_metadata(ctx);
+}
+
+// Writes the superblock and every cached block of the mounted disk back to the disk file
+void fs_sync(FsContext *ctx) {
+    lock_metadata(ctx, true);
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+    } else {
+        sync_superblock(ctx);
+        flush_cache(ctx);
+    }
+    unlock_metadata(ctx);
+}
+
+// Ends a command file: a sync point, after which the disk is closed unless the context shares it
+void fs_finish(FsContext *ctx) {
+    lock_metadata(ctx, true);
+    sync_superblock(ctx);
+    if (ctx->volume == &ctx->own_volume) {
+        close_disk(ctx);
+    }
+    unlock_metadata(ctx);
+}
+
+// Reports a corrupted block with the file that holds it
+static void report_corrupt_block(FsContext *ctx, uint32_t block) {
+    const Superblock *sb = &ctx->volume->superblock;
+    uint32_t words = (sb->num_inodes + 63) / 64;
+    for (uint32_t word = 0; word < words; word++) {
+        for (uint64_t bits = file_inode_bits(ctx, word); bits != 0; bits &= bits - 1) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            const Inode *inode = &sb->inode[i];
+            if (inode->flags & INODE_EXTENTS && inode->start_block == block) {
+                fprintf(ctx->err, "Error: Extent block of %.5s is corrupted\n", inode->name);
+                return;
+            }
+            FileExtent single;
+            const FileExtent *runs;
+            uint32_t run_count = file_runs(sb, i, &single, &runs);
+            for (uint32_t k = 0; k < run_count; k++) {
+                if (block >= runs[k].start && block < runs[k].start + runs[k].count) {
+                    fprintf(ctx->err, "Error: Block %u of %.5s is corrupted\n", runs[k].logical + (block - runs[k].start), inode->name);
+                    return;
+                }
+            }
+        }
+    }
+    fprintf(ctx->err, "Error: Free block %u is corrupted\n", block);
+}
+
+// Checks every data block that has a checksum against it, reading the disk front to back in runs of up to
+// MOVE_CHUNK_BYTES; each corrupted block is reported with its file, then the number of blocks checked and corrupted
+static void scrub_disk(FsContext *ctx) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
-    Inode *inode = find_inode_by_name(name, current_inode_index);
-    // Find named directory in current directory
-    if (!inode || !(inode->isdir_parent & 0x80)) {
-        fprintf(stderr, "Error: Directory %.5s does not exist\n", name);
+    const Superblock *sb = &ctx->volume->superblock;
+    if (!sb->block_checksums) {
+        fprintf(ctx->err, "Error: Disk %s has no block checksums\n", ctx->volume->current_disk_name);
         return;
     }
-    // Update current directory index
-    for (int i = 0; i < 126; i++) {
-        if (&superblock.inode[i] == inode) {
-            current_inode_index = i;
+    int run_blocks = move_run_blocks(ctx);
+    uint8_t *run = malloc((size_t)run_blocks * sb->block_size);
+    if (!run) {
+        fprintf(ctx->err, "Error: Out of memory\n");
+        return;
+    }
+    unsigned long checked = 0;
+    unsigned long corrupted = 0;
+    uint32_t block = sb->data_start;
+    for (;;) {
+        while (block < sb->num_blocks && sb->block_checksums[block] == 0) {
+            block++; // Free and never written blocks have nothing to check, and are not read
+        }
+        if (block == sb->num_blocks) {
             break;
         }
+        int count = sb->num_blocks - block < (uint32_t)run_blocks ? (int)(sb->num_blocks - block) : run_blocks;
+        ctx->corrupt_block = -1;
+        read_blocks(ctx, block, count, run); // Checks the run on the way in (cached changes are written back first)
+        for (int i = 0; i < count; i++) {
+            checked += sb->block_checksums[block + i] != 0;
+        }
+        if (ctx->corrupt_block != -1) {
+            // Rare: find every corrupted block of the run, not just the first
+            for (uint32_t bad = ctx->corrupt_block; bad < block + count; bad++) {
+                const uint8_t *data = run + (size_t)(bad - block) * sb->block_size;
+                if (sb->block_checksums[bad] != 0 && crc32c(0, data, sb->block_size) != sb->block_checksums[bad]) {
+                    report_corrupt_block(ctx, bad);
+                    corrupted++;
+                }
+            }
+        }
+        ctx->corrupt_block = -1;
+        block += count;
+    }
+    free(run);
+    fprintf(ctx->out, "Scrub: %lu blocks checked, %lu corrupted\n", checked, corrupted);
+}
+
+// Runs scrub_disk with the metadata lock held exclusive, so no block changes while it is read
+void fs_scrub(FsContext *ctx) {
+    lock_metadata(ctx, true);
+    scrub_disk(ctx);
+    unlock_metadata(ctx);
+}
+
+// Changes the current working directory to a directory with the specified name in the command's directory
+static void change_directory(FsContext *ctx, char name[5]) {
+    if (!ctx->volume->is_mounted) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return;
+    }
+    int dir = resolve_path_directory(ctx);
+    if (dir == -1) {
+        return;
     }
-}
\ No newline at end of file
+    // That directory itself
+    if (strcmp(name, ".") == 0) {
+        ctx->current_inode_index = dir;
+        return;
+    // Its parent
+    } else if (strcmp(name, "..") == 0) {
+        if (dir != (int)ctx->volume->superblock.root) {
+            dir = ctx->volume->superblock.inode[dir].isdir_parent & INODE_FIELD_MASK;
+        }
+        ctx->current_inode_index = dir;
+        return;
+    }
+    Inode *inode = find_inode_by_name(ctx, name, dir);
+    // Find named directory in that directory
+    if (!inode || !(inode->isdir_parent & INODE_DIR)) {
+        fprintf(ctx->err, "Error: Directory %.5s does not exist\n", name);
+        return;
+    }
+    ctx->current_inode_index = inode - ctx->volume->superblock.inode; // Update current directory index
+}
+
+// Runs change_directory with the metadata lock held shared
+void fs_cd(FsContext *ctx, char name[5]) {
+    lock_metadata(ctx, false);
+    change_directory(ctx, name);
+    unlock_metadata(ctx);
+}
@@ -1,35 +1,137 @@
 #ifndef FS_SIM_H
 #define FS_SIM_H
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+// Superblock mutations allowed between automatic writes of block 0 (override with -DSYNC_INTERVAL=n)
+#ifndef SYNC_INTERVAL
+#define SYNC_INTERVAL 16
+#endif
+
+#define INODE_USED 0x80000000u // isused_size: inode is in use
+#define INODE_DIR 0x80000000u // isdir_parent: inode is a directory
+#define INODE_FIELD_MASK 0x7FFFFFFFu // isused_size / isdir_parent: size or parent index
+#define INODE_EXTENTS 0x01 // flags: start_block is the block holding the file's extent list (version 2 only)
+
+// Geometry of a version 1 disk (the original fixed format)
+#define V1_BLOCK_SIZE 1024
+#define V1_NUM_BLOCKS 128
+#define V1_NUM_INODES 126
+
+// Block size limits of a version 2 disk (a power of two in between)
+#define V2_MIN_BLOCK_SIZE 512
+#define V2_MAX_BLOCK_SIZE 65536
+
+// Optional parts of a version 2 disk, chosen when it is formatted
+#define FEATURE_JOURNAL 0x1   // Metadata journal (journal.c)
+#define FEATURE_CHECKSUMS 0x2 // Table of data block checksums
+
+// In-memory inode, also the on-disk inode of a version 2 disk
+typedef struct {
+    char name[5];          // name of the file/directory
+    uint8_t flags;         // INODE_EXTENTS for an extent-mapped file, 0 otherwise
+    uint8_t reserved[2];   // unused, zero on disk
+    uint32_t isused_size;  // state of inode (bit 31) and size of the file/directory
+    uint32_t start_block;  // index of the first block of the file/directory
+    uint32_t isdir_parent; // type of inode (bit 31) and index of the parent inode
+} Inode;
+
+// On-disk inode of a version 1 disk
 typedef struct {
     char name[5];         // name of the file/directory
     uint8_t isused_size;  // state of inode and size of the file/directory
     uint8_t start_block;  // index of the first block of the file/directory
     uint8_t isdir_parent; // type of inode and index of the parent inode
-} Inode;
+} InodeV1;
 
+// Block 0 of a version 1 disk
 typedef struct {
     uint8_t free_block_list[16];
-    Inode inode[126];
+    InodeV1 inode[126];
+} SuperblockV1;
+
+// Start of block 0 of a version 2 disk; the bitmap and inode table follow in their own blocks
+typedef struct {
+    uint8_t magic[8];      // FS_V2_MAGIC
+    uint32_t version;      // 2
+    uint32_t block_size;   // bytes per block
+    uint32_t num_blocks;   // blocks on the disk, metadata included
+    uint32_t num_inodes;   // entries in the inode table
+    uint32_t bitmap_start; // first block of the free block bitmap
+    uint32_t inode_start;  // first block of the inode table
+    uint32_t data_start;   // first data block
+    uint32_t journal_start; // first block of the metadata journal, 0 if the disk has none
+    uint32_t checksum_start; // first block of the block checksum table, 0 if the disk has none
+} SuperblockV2Header;
+
+// One run of an extent-mapped file (stored on disk as start and count only)
+typedef struct {
+    uint32_t logical; // first block of the file held by the run
+    uint32_t start;   // first disk block of the run
+    uint32_t count;   // blocks in the run
+} FileExtent;
+
+// Runs of an extent-mapped file in file order, loaded from its extent block
+typedef struct {
+    uint32_t count;   // number of runs, 0 for a contiguous file or directory
+    FileExtent *runs; // runs, logical starts ascending
+} ExtentList;
+
+// In-memory superblock of the mounted disk, whatever its on-disk version
+typedef struct {
+    uint32_t version;         // on-disk format, 1 or 2
+    uint32_t block_size;      // bytes per block
+    uint32_t num_blocks;      // blocks on the disk, metadata included
+    uint32_t num_inodes;      // entries in the inode table
+    uint32_t root;            // parent index that stands for the root directory (num_inodes + 1)
+    uint32_t bitmap_start;    // first block of the free block bitmap
+    uint32_t inode_start;     // first block of the inode table
+    uint32_t data_start;      // first data block, and the number of metadata blocks
+    uint32_t journal_start;   // first block of the metadata journal (its commit block), 0 if none; it ends at data_start
+    uint32_t checksum_start;  // first block of the block checksum table, 0 if none; it ends at journal_start or data_start
+    uint8_t *free_block_list; // one bit per block, most significant bit first, 1 = allocated
+    uint32_t *block_checksums; // CRC32C of each data block as last written, 0 if unchecked; NULL if the disk has no table
+    Inode *inode;             // inode table
+    ExtentList *extents;      // extent list of each inode (empty unless the inode is extent-mapped)
 } Superblock;
 
-void fs_mount(char *new_disk_name);
-void fs_create(char name[5], int size);
-void fs_delete(char name[5]);
-void fs_read(char name[5], int block_num);
-void fs_write(char name[5], int block_num);
-void fs_buff(uint8_t buff[1024]);
-void fs_ls(void);
-void fs_defrag(void);
-void fs_cd(char name[5]);
-
-extern char current_disk_name[1000];
-extern Superblock superblock;
-extern uint8_t buffer[1024];
-extern int current_inode_index;
-extern bool is_mounted;
-extern int disk_fd;
-
-#endif
\ No newline at end of file
+typedef struct FsContext FsContext; // State of one file system instance, see fs-context.h
+
+void init_context(FsContext *ctx, FILE *out, FILE *err);
+void init_shared_context(FsContext *ctx, FsContext *owner, FILE *out, FILE *err);
+void free_context(FsContext *ctx);
+int check_consistency(FsContext *ctx, Superblock *sb, char *disk_name);
+int load_superblock(int fd, Superblock *sb);
+void free_superblock(Superblock *sb);
+int format_disk(const char *disk_name, int version, uint32_t block_size, uint32_t num_blocks, uint32_t num_inodes, uint32_t features);
+void encode_metadata_block(const Superblock *sb, uint32_t block_num, uint8_t *out);
+void fs_mount(FsContext *ctx, char *new_disk_name);
+void fs_create(FsContext *ctx, char name[5], int size);
+void fs_delete(FsContext *ctx, char name[5]);
+void fs_read(FsContext *ctx, char name[5], int block_num);
+void fs_write(FsContext *ctx, char name[5], int block_num);
+void fs_read_range(FsContext *ctx, char name[5], int start, int count);
+void fs_write_range(FsContext *ctx, char name[5], int start, int count);
+void fs_buff(FsContext *ctx, const uint8_t *buff, int length);
+void fs_ls(FsContext *ctx);
+void fs_defrag(FsContext *ctx);
+void fs_defrag_step(FsContext *ctx, int max_blocks);
+void fs_cd(FsContext *ctx, char name[5]);
+void fs_sync(FsContext *ctx);
+void fs_finish(FsContext *ctx);
+void fs_scrub(FsContext *ctx);
+void release_file_blocks(FsContext *ctx, int inode_index);
+int fs_block_size(const FsContext *ctx);
+int fs_max_file_blocks(const FsContext *ctx);
+void mark_superblock_dirty(FsContext *ctx);
+void mark_inode_dirty(FsContext *ctx, int inode_index);
+void mark_bitmap_dirty(FsContext *ctx, int block_num);
+void mark_checksum_dirty(FsContext *ctx, int block_num);
+void sync_superblock(FsContext *ctx);
+int set_read_ahead(const char *blocks);
+
+extern bool report_all_violations;
+extern int read_ahead_blocks;
+
+#endif
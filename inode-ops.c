@@ -1,93 +1,223 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "fs-sim.h"
-#include "disk-ops.h"
-
-int find_free_inode(void) {
-    for (int i = 0; i < 126; i++) {
-        // Check if current inode is free (MSB of isused_size is 0)
-        if (!(superblock.inode[i].isused_size & 0x80)) {
-            return i; // Return index of first free inode found
+#include "fs-context.h"
+
+// Returns the lowest inode from from on whose bit is clear in bits, or num_inodes if there is none
+static uint32_t next_clear_bit(const uint64_t *bits, uint32_t from, uint32_t num_inodes) {
+    uint32_t words = (num_inodes + 63) / 64;
+    for (uint32_t word = from / 64; word < words; word++) {
+        uint64_t clear = ~bits[word];
+        if (word == from / 64) {
+            clear &= ~0ULL << (from % 64); // Ignore inodes before from
+        }
+        if (clear != 0) {
+            uint32_t i = word * 64 + __builtin_ctzll(clear); // 64 inodes per step instead of one decoded inode
+            return i < num_inodes ? i : num_inodes; // Padding bits past the table do not count
         }
     }
+    return num_inodes;
+}
+
+int find_free_inode(FsContext *ctx) {
+    DirIndex *index = &ctx->volume->index;
+    uint32_t num_inodes = ctx->volume->superblock.num_inodes;
+    ctx->lookup_stats.free_inode_searches++;
+    // First clear bit of the used bitset at or after the hint
+    uint32_t i = index->free_inode_hint < num_inodes ? next_clear_bit(index->used_bits, index->free_inode_hint, num_inodes) : num_inodes;
+    if (i < num_inodes) {
+        ctx->lookup_stats.free_inode_probes += i - index->free_inode_hint + 1;
+        index->free_inode_hint = i;
+        return i; // Return index of first free inode found
+    }
+    ctx->lookup_stats.free_inode_probes += ctx->volume->superblock.num_inodes - index->free_inode_hint;
+    index->free_inode_hint = ctx->volume->superblock.num_inodes;
     return -1; // No free inodes available
 }
 
-bool is_name_unique_in_directory(int parent_inode, char name[5]) {
-    // Loop through all inodes to check for name conflicts
-    for (int i = 0; i < 126; i++) {
-        // Check if current inode is in use
-        if (superblock.inode[i].isused_size & 0x80) {
-            int file_parent = superblock.inode[i].isdir_parent & 0x7F;
-            // Check if this file/directory has the same parent and same name
-            if (file_parent == parent_inode && 
-                memcmp(superblock.inode[i].name, name, 5) == 0) {
-                return false; // Name is not unique
-            }
-        }
+// Hashes a (parent directory, name) pair into a bucket of the name index
+static int name_hash(const DirIndex *index, int parent_inode, const char name[5]) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent_inode; // FNV-1a over the parent index and the 5 name bytes
+    for (int i = 0; i < 5; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
     }
-    return true; // Name is unique
+    return hash & (index->hash_buckets - 1);
 }
 
-Inode* find_inode_by_name(char name[5], int parent_inode) {
-    // Loop through all inodes to find matching name
-    for (int i = 0; i < 126; i++) {
-        if (superblock.inode[i].isused_size & 0x80) {
-            int file_parent = superblock.inode[i].isdir_parent & 0x7F;
-            // Check if this file/directory has the same parent and same name
-            if (file_parent == parent_inode && memcmp(superblock.inode[i].name, name, 5) == 0) {
-                return &superblock.inode[i]; // Return pointer to the matching inode
-            }
-        }
+// Links an inode into its parent's children list and the name hash
+static void link_inode(FsContext *ctx, int inode_index) {
+    DirIndex *index = &ctx->volume->index;
+    int parent = ctx->volume->superblock.inode[inode_index].isdir_parent & INODE_FIELD_MASK;
+    index->prev_sibling[inode_index] = -1;
+    index->next_sibling[inode_index] = index->first_child[parent];
+    if (index->first_child[parent] != -1) {
+        index->prev_sibling[index->first_child[parent]] = inode_index;
     }
-    return NULL; // No matching inode
+    index->first_child[parent] = inode_index;
+    index->child_count[parent]++;
+    index->used_bits[inode_index / 64] |= 1ULL << (inode_index % 64);
+    if (ctx->volume->superblock.inode[inode_index].isdir_parent & INODE_DIR) {
+        index->dir_bits[inode_index / 64] |= 1ULL << (inode_index % 64);
+    }
+    int bucket = name_hash(index, parent, ctx->volume->superblock.inode[inode_index].name);
+    index->hash_next[inode_index] = index->hash_head[bucket];
+    index->hash_head[bucket] = inode_index;
 }
 
-void recursive_delete(int inode_index) {
-    if (inode_index < 0 || inode_index >= 126) {
-        return;
+// Rebuilds the directory index (children lists, child counts, name hash and used and directory bitsets) from the
+// superblock
+void build_dir_index(FsContext *ctx) {
+    DirIndex *index = &ctx->volume->index;
+    uint32_t dirs = ctx->volume->superblock.root + 1; // Every inode index plus the root can be a parent
+    uint32_t words = (ctx->volume->superblock.num_inodes + 63) / 64;
+    index->hash_buckets = 256;
+    while (index->hash_buckets < ctx->volume->superblock.num_inodes) {
+        index->hash_buckets *= 2;
+    }
+    index->first_child = realloc(index->first_child, dirs * sizeof(int));
+    index->child_count = realloc(index->child_count, dirs * sizeof(int));
+    index->next_sibling = realloc(index->next_sibling, ctx->volume->superblock.num_inodes * sizeof(int));
+    index->prev_sibling = realloc(index->prev_sibling, ctx->volume->superblock.num_inodes * sizeof(int));
+    index->hash_next = realloc(index->hash_next, ctx->volume->superblock.num_inodes * sizeof(int));
+    index->hash_head = realloc(index->hash_head, index->hash_buckets * sizeof(int));
+    index->used_bits = realloc(index->used_bits, words * sizeof(uint64_t));
+    index->dir_bits = realloc(index->dir_bits, words * sizeof(uint64_t));
+    if (!index->first_child || !index->child_count || !index->next_sibling || !index->prev_sibling || !index->hash_next ||
+        !index->hash_head || !index->used_bits || !index->dir_bits) {
+        fprintf(ctx->err, "Error: Out of memory indexing %s\n", ctx->volume->current_disk_name);
+        exit(1);
     }
-    Inode *inode = &superblock.inode[inode_index];
-    if (inode->isdir_parent & 0x80) {
-        // Directory - delete all children first
-        for (int i = 0; i < 126; i++) {
-            // Skip the current directory and only check used inodes
-            if (i != inode_index && superblock.inode[i].isused_size & 0x80) {
-                // Extract parent index of child
-                int parent = superblock.inode[i].isdir_parent & 0x7F;
-                // Check if this inode is a child of the directory being deleted
-                if (parent == inode_index) {
-                    recursive_delete(i);
-                }
-            }
+    for (uint32_t i = 0; i < dirs; i++) {
+        index->first_child[i] = -1;
+        index->child_count[i] = 0;
+    }
+    for (uint32_t i = 0; i < index->hash_buckets; i++) {
+        index->hash_head[i] = -1;
+    }
+    memset(index->used_bits, 0, words * sizeof(uint64_t));
+    memset(index->dir_bits, 0, words * sizeof(uint64_t));
+    for (uint32_t i = 0; i < ctx->volume->superblock.num_inodes; i++) {
+        if (ctx->volume->superblock.inode[i].isused_size & INODE_USED) {
+            link_inode(ctx, i);
         }
+    }
+    index->free_inode_hint = 0;
+}
+
+// Releases the directory index of a context
+void free_dir_index(FsContext *ctx) {
+    DirIndex *index = &ctx->volume->index;
+    free(index->first_child);
+    free(index->next_sibling);
+    free(index->prev_sibling);
+    free(index->child_count);
+    free(index->hash_head);
+    free(index->hash_next);
+    free(index->used_bits);
+    free(index->dir_bits);
+    *index = (DirIndex){0};
+}
+
+// Adds a newly used inode to the directory index
+void index_add(FsContext *ctx, int inode_index) {
+    link_inode(ctx, inode_index);
+}
+
+// Removes an inode from the directory index; call before the inode is cleared
+void index_remove(FsContext *ctx, int inode_index) {
+    DirIndex *index = &ctx->volume->index;
+    int parent = ctx->volume->superblock.inode[inode_index].isdir_parent & INODE_FIELD_MASK;
+    if (index->prev_sibling[inode_index] != -1) {
+        index->next_sibling[index->prev_sibling[inode_index]] = index->next_sibling[inode_index];
     } else {
-        // File - free data blocks
-        int start = inode->start_block;
-        int size = inode->isused_size & 0x7F;
-        // Only free blocks if file actually has allocated blocks
-        if (start > 0 && size > 0) {
-            update_free_blocks(start, size, false); // Zero out data blocks
-            uint8_t zero_block[1024] = {0};
-            for (int i = 0; i < size; i++) {
-                write_block(start + i, zero_block);
-            }
+        index->first_child[parent] = index->next_sibling[inode_index];
+    }
+    if (index->next_sibling[inode_index] != -1) {
+        index->prev_sibling[index->next_sibling[inode_index]] = index->prev_sibling[inode_index];
+    }
+    index->child_count[parent]--;
+    int *link = &index->hash_head[name_hash(index, parent, ctx->volume->superblock.inode[inode_index].name)];
+    while (*link != inode_index) {
+        link = &index->hash_next[*link];
+    }
+    *link = index->hash_next[inode_index];
+    index->used_bits[inode_index / 64] &= ~(1ULL << (inode_index % 64));
+    index->dir_bits[inode_index / 64] &= ~(1ULL << (inode_index % 64));
+    if ((uint32_t)inode_index < index->free_inode_hint) {
+        index->free_inode_hint = inode_index; // The inode is about to become free
+    }
+}
+
+// Returns the first child of a directory (children are not kept in any particular order), or -1 if it is empty
+int first_child_of(const FsContext *ctx, int dir_inode_index) {
+    return ctx->volume->index.first_child[dir_inode_index];
+}
+
+// Returns the next child of the same directory after inode_index, or -1
+int next_child(const FsContext *ctx, int inode_index) {
+    return ctx->volume->index.next_sibling[inode_index];
+}
+
+// Returns the files (used inodes that are not directories) among inodes 64 * word to 64 * word + 63 as a mask, bit k
+// for inode 64 * word + k; a sweep over the files of the table takes one word of the bitsets per 64 inodes
+uint64_t file_inode_bits(const FsContext *ctx, uint32_t word) {
+    return ctx->volume->index.used_bits[word] & ~ctx->volume->index.dir_bits[word];
+}
+
+bool is_name_unique_in_directory(FsContext *ctx, int parent_inode, char name[5]) {
+    return find_inode_by_name(ctx, name, parent_inode) == NULL; // Name is unique if the index has no entry for it
+}
+
+Inode* find_inode_by_name(FsContext *ctx, char name[5], int parent_inode) {
+    DirIndex *index = &ctx->volume->index;
+    ctx->lookup_stats.name_lookups++;
+    // Walk the hash chain for (parent, name)
+    for (int i = index->hash_head[name_hash(index, parent_inode, name)]; i != -1; i = index->hash_next[i]) {
+        ctx->lookup_stats.name_probes++;
+        int file_parent = ctx->volume->superblock.inode[i].isdir_parent & INODE_FIELD_MASK;
+        // Check if this file/directory has the same parent and same name
+        if (file_parent == parent_inode && memcmp(ctx->volume->superblock.inode[i].name, name, 5) == 0) {
+            return &ctx->volume->superblock.inode[i]; // Return pointer to the matching inode
         }
     }
+    return NULL; // No matching inode
+}
+
+// Frees one inode whose children (if it is a directory) are already gone
+static void delete_inode(FsContext *ctx, int inode_index) {
+    Inode *inode = &ctx->volume->superblock.inode[inode_index];
+    if (!(inode->isdir_parent & INODE_DIR)) {
+        // File - free data blocks (and the extent block of an extent-mapped file)
+        release_file_blocks(ctx, inode_index);
+    }
+    index_remove(ctx, inode_index);
     memset(inode, 0, sizeof(Inode)); // Zero out the inode
+    mark_inode_dirty(ctx, inode_index);
 }
 
-int count_children(int dir_inode_index) {
-    int count = 0;
-    // Loop through all inodes to count children of specified directory
-    for (int i = 0; i < 126; i++) {
-        if (superblock.inode[i].isused_size & 0x80) {
-            int parent = superblock.inode[i].isdir_parent & 0x7F;
-            if (parent == dir_inode_index) {
-                count++;
-            }
+// Deletes a file, or a directory and everything below it, children before their parent. The walk is iterative and
+// driven by the children lists: it descends to a childless inode, deletes it (which unlinks it from its parent's list)
+// and resumes from the parent, so every inode of the tree is visited a constant number of times and deep trees cannot
+// overflow the stack. Freed blocks are only queued for zeroing; the caller runs zero_deferred_blocks.
+void recursive_delete(FsContext *ctx, int inode_index) {
+    const DirIndex *index = &ctx->volume->index;
+    if (inode_index < 0 || inode_index >= (int)ctx->volume->superblock.num_inodes) {
+        return;
+    }
+    int node = inode_index;
+    for (;;) {
+        while (index->first_child[node] != -1 && (ctx->volume->superblock.inode[node].isdir_parent & INODE_DIR)) {
+            node = index->first_child[node]; // Descend to an inode without children
+        }
+        int parent = ctx->volume->superblock.inode[node].isdir_parent & INODE_FIELD_MASK;
+        delete_inode(ctx, node);
+        if (node == inode_index) {
+            return;
         }
+        node = parent;
     }
-    return count + 2; // Add 2 for special entries "." and ".."
-}
\ No newline at end of file
+}
+
+int count_children(const FsContext *ctx, int dir_inode_index) {
+    return ctx->volume->index.child_count[dir_inode_index] + 2; // Add 2 for special entries "." and ".."
+}
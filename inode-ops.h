@@ -2,10 +2,38 @@
 #define INODE_OPS_H
 #include "fs-sim.h"
 
-int find_free_inode(void);
-bool is_name_unique_in_directory(int parent_inode, char name[5]);
-Inode* find_inode_by_name(char name[5], int parent_inode);
-void recursive_delete(int inode_index);
-int count_children(int dir_inode_index);
+typedef struct {
+    unsigned long name_lookups;        // find_inode_by_name calls
+    unsigned long name_probes;         // hash chain entries compared by those lookups
+    unsigned long free_inode_searches; // find_free_inode calls
+    unsigned long free_inode_probes;   // inodes examined by those searches
+} LookupStats;
 
-#endif
\ No newline at end of file
+// In-memory directory index of the mounted disk, rebuilt at mount
+typedef struct {
+    int *first_child;         // First child of each directory (index root is the root directory), -1 if none
+    int *next_sibling;        // Next child of the same directory, -1 at the end of the list
+    int *prev_sibling;        // Previous child of the same directory, -1 at the start of the list
+    int *child_count;         // Number of children of each directory
+    int *hash_head;           // First inode in each name hash bucket, -1 if empty
+    int *hash_next;           // Next inode in the same name hash bucket, -1 at the end of the chain
+    uint32_t hash_buckets;    // Buckets in the (parent, name) hash, a power of two
+    uint32_t free_inode_hint; // No inode below this index is free
+    uint64_t *used_bits;      // Bit i % 64 of word i / 64 set while inode i is used
+    uint64_t *dir_bits;       // The same for inodes that are used directories
+} DirIndex;
+
+int find_free_inode(FsContext *ctx);
+bool is_name_unique_in_directory(FsContext *ctx, int parent_inode, char name[5]);
+Inode* find_inode_by_name(FsContext *ctx, char name[5], int parent_inode);
+void recursive_delete(FsContext *ctx, int inode_index);
+int count_children(const FsContext *ctx, int dir_inode_index);
+void build_dir_index(FsContext *ctx);
+void free_dir_index(FsContext *ctx);
+void index_add(FsContext *ctx, int inode_index);
+void index_remove(FsContext *ctx, int inode_index);
+int first_child_of(const FsContext *ctx, int dir_inode_index);
+int next_child(const FsContext *ctx, int inode_index);
+uint64_t file_inode_bits(const FsContext *ctx, uint32_t word);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "fs-context.h"
+#include "journal.h"
+
+// A version 2 disk formatted with a journal never overwrites metadata in place until the new metadata is committed.
+// A sync point (S, a mount, the end of a command file, every SYNC_INTERVAL superblock mutations) is one transaction:
+//   1. the cached data blocks (new extent blocks among them) are flushed, and a copy of every changed metadata block
+//      is written to its slot in the journal
+//   2. the commit block is written: the map of the blocks in the transaction and a checksum over it and the copies
+//   3. the metadata blocks are written in place
+// with a barrier (fdatasync) after each step. A crash before the commit block is complete leaves the old metadata in
+// place and a commit block whose checksum does not match, so mount discards it; after that, mount replays the copies.
+// Replaying a transaction twice writes the same blocks again, so the commit block is only cleared after a replay.
+
+// Returns the number of metadata blocks whose bit fits the map in a commit block
+uint32_t journal_map_capacity(uint32_t block_size) {
+    return (block_size - sizeof(JournalHeader)) * 8;
+}
+
+static bool map_has(const uint8_t *map, uint32_t block) {
+    return (map[block / 8] >> (7 - block % 8)) & 1;
+}
+
+// Checksum of a transaction: its block count, its map, then the copies in block order
+static uint32_t transaction_checksum(uint32_t count, const uint8_t *map, uint32_t map_bytes, const uint8_t *copies,
+                                     size_t copies_bytes) {
+    uint32_t crc = crc32c(0, (const uint8_t *)&count, sizeof(count));
+    crc = crc32c(crc, map, map_bytes);
+    return crc32c(crc, copies, copies_bytes);
+}
+
+// Writes the blocks marked in the map from consecutive copies, one write per run of consecutive blocks, at first + block
+static void write_marked_runs(FsContext *ctx, uint32_t first, const uint8_t *map, uint32_t blocks, const uint8_t *copies) {
+    uint32_t block_size = ctx->volume->superblock.block_size;
+    uint32_t block = 0;
+    while (block < blocks) {
+        if (!map_has(map, block)) {
+            block++;
+            continue;
+        }
+        uint32_t end = block + 1;
+        while (end < blocks && map_has(map, end)) {
+            end++;
+        }
+        write_blocks(ctx, first + block, end - block, copies);
+        copies += (size_t)(end - block) * block_size;
+        block = end;
+    }
+}
+
+// Writes the changed metadata blocks of the mounted disk as one transaction; returns -1 if out of memory (nothing is
+// written then, and the blocks stay dirty)
+int journal_commit(FsContext *ctx) {
+    FsVolume *volume = ctx->volume;
+    const Superblock *sb = &volume->superblock;
+    uint32_t blocks = sb->journal_start; // Metadata blocks that have a slot (the journal is not journaled)
+    uint32_t count = 0;
+    for (uint32_t block = 0; block < blocks; block++) {
+        count += volume->metadata_dirty[block];
+    }
+    if (count == 0) {
+        return 0;
+    }
+    uint8_t *commit = calloc(1, sb->block_size);
+    uint8_t *copies = malloc((size_t)count * sb->block_size);
+    if (!commit || !copies) {
+        free(commit);
+        free(copies);
+        return -1;
+    }
+    uint8_t *map = commit + sizeof(JournalHeader);
+    uint8_t *copy = copies;
+    for (uint32_t block = 0; block < blocks; block++) {
+        if (volume->metadata_dirty[block]) {
+            encode_metadata_block(sb, block, copy);
+            map[block / 8] |= 1 << (7 - block % 8);
+            copy += sb->block_size;
+        }
+    }
+    JournalHeader header;
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.count = count;
+    header.checksum = transaction_checksum(count, map, (blocks + 7) / 8, copies, (size_t)count * sb->block_size);
+    memcpy(commit, &header, sizeof(header));
+    flush_cache(ctx); // Data the new metadata points to (extent blocks, zeroed blocks) reaches the disk first
+    write_marked_runs(ctx, sb->journal_start + 1, map, blocks, copies);
+    sync_disk(ctx);
+    write_blocks(ctx, sb->journal_start, 1, commit);
+    sync_disk(ctx);
+    write_marked_runs(ctx, 0, map, blocks, copies);
+    sync_disk(ctx); // The slots are only reused once the blocks they protect are stored in place
+    for (uint32_t block = 0; block < blocks; block++) {
+        volume->metadata_dirty[block] = false;
+    }
+    free(copies);
+    free(commit);
+    return 0;
+}
+
+// Replays the transaction committed to the journal of a disk file, if any, before its metadata is loaded; sb only needs
+// the geometry. Returns the number of blocks replayed, 0 if the journal holds no complete transaction, -1 on error.
+int journal_recover(int fd, const Superblock *sb) {
+    if (sb->journal_start == 0) {
+        return 0;
+    }
+    uint32_t blocks = sb->journal_start;
+    uint8_t *commit = malloc(sb->block_size);
+    if (!commit) {
+        return -1;
+    }
+    JournalHeader header;
+    if (pread(fd, commit, sb->block_size, (off_t)sb->journal_start * sb->block_size) != (ssize_t)sb->block_size) {
+        free(commit);
+        return -1;
+    }
+    memcpy(&header, commit, sizeof(header));
+    const uint8_t *map = commit + sizeof(JournalHeader);
+    uint32_t marked = 0;
+    for (uint32_t block = 0; block < blocks; block++) {
+        marked += map_has(map, block);
+    }
+    if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 || header.count == 0 || header.count != marked) {
+        free(commit);
+        return 0; // Empty, or a commit block torn before it was complete
+    }
+    uint8_t *copies = malloc((size_t)header.count * sb->block_size);
+    int status = copies ? 0 : -1;
+    uint8_t *copy = copies;
+    for (uint32_t block = 0; status == 0 && block < blocks; block++) {
+        if (map_has(map, block)) {
+            off_t slot = (off_t)(sb->journal_start + 1 + block) * sb->block_size;
+            status = pread(fd, copy, sb->block_size, slot) == (ssize_t)sb->block_size ? 0 : -1;
+            copy += sb->block_size;
+        }
+    }
+    if (status == 0 && transaction_checksum(header.count, map, (blocks + 7) / 8, copies,
+                                            (size_t)header.count * sb->block_size) != header.checksum) {
+        free(copies);
+        free(commit);
+        return 0; // The copies do not match: the next transaction had started overwriting them, nothing to replay
+    }
+    copy = copies;
+    for (uint32_t block = 0; status == 0 && block < blocks; block++) {
+        if (map_has(map, block)) {
+            status = pwrite(fd, copy, sb->block_size, (off_t)block * sb->block_size) == (ssize_t)sb->block_size ? 0 : -1;
+            copy += sb->block_size;
+        }
+    }
+    if (status == 0 && fdatasync(fd) == 0) {
+        memset(commit, 0, sb->block_size); // Replayed: the journal is empty again
+        if (pwrite(fd, commit, sb->block_size, (off_t)sb->journal_start * sb->block_size) != (ssize_t)sb->block_size ||
+            fdatasync(fd) != 0) {
+            status = -1;
+        }
+    }
+    free(copies);
+    free(commit);
+    return status == 0 ? (int)header.count : -1;
+}
@@ -0,0 +1,20 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <stdint.h>
+#include "fs-sim.h"
+
+#define JOURNAL_MAGIC "FSIMJNL1"
+
+// Start of the commit block of a version 2 disk's metadata journal; a map with one bit per metadata block (most
+// significant bit first) follows it, and the copy of metadata block b is kept in journal block 1 + b
+typedef struct {
+    uint8_t magic[8];  // JOURNAL_MAGIC while the journal holds a committed transaction
+    uint32_t count;    // Metadata blocks in the transaction
+    uint32_t checksum; // CRC32C of count, the map and the copies of the blocks it marks, in block order
+} JournalHeader;
+
+uint32_t journal_map_capacity(uint32_t block_size);
+int journal_commit(FsContext *ctx);
+int journal_recover(int fd, const Superblock *sb);
+
+#endif
@@ -1,15 +1,77 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "checksum.h"
 #include "command-processor.h"
-#include "disk-ops.h"
+#include "fs-context.h"
 
 int main(int argc, char *argv[]) {
     // Expected format: ./fs-sim <command-file>
     if (argc != 2) {
         return 1;
     }
-    process_command_file(argv[1]);
-    close_disk(); // Ensure disk is closed when program exits
+    // Allocation policy for new files: first (default), best or next fit
+    char *policy = getenv("FS_ALLOC_POLICY");
+    if (policy) {
+        set_alloc_policy(policy);
+    }
+    // I/O backend for mounted disks: fd (default) or mmap
+    char *backend = getenv("FS_DISK_BACKEND");
+    if (backend) {
+        set_disk_backend(backend);
+    }
+    // Zero freed blocks by punching holes in the disk file instead of writing zeros, where the host file system allows it
+    if (getenv("FS_PUNCH_HOLES")) {
+        punch_holes = true;
+    }
+    // CRC32C implementation for block checksums: "hardware" (SSE4.2, the default where available) or "table"
+    char *crc_impl = getenv("FS_CRC32C");
+    if (crc_impl) {
+        set_checksum_impl(crc_impl);
+    }
+    // Simulate a crash on the nth write to a disk (half of that write reaches the disk), for crash recovery tests
+    char *crash_writes = getenv("FS_CRASH_AFTER_WRITES");
+    if (crash_writes) {
+        crash_after_writes = atol(crash_writes);
+    }
+    // Largest read-ahead window for sequential single-block reads, in blocks (0 turns read-ahead off)
+    char *read_ahead = getenv("FS_READ_AHEAD");
+    if (read_ahead) {
+        set_read_ahead(read_ahead);
+    }
+    // Print every consistency violation found at mount, for triaging damaged disks
+    if (getenv("FS_FSCK_REPORT")) {
+        report_all_violations = true;
+    }
+    // Measure command and I/O latencies, and write every statistic to the named file as JSON at exit
+    char *stats_file = getenv("FS_STATS");
+    if (stats_file) {
+        stats_enabled = true;
+    }
+    // Log every block read and write, with the command that made it, to the named file (replay it with bench/trace-replay)
+    char *trace = getenv("FS_TRACE");
+    if (trace && open_trace(trace) == -1) {
+        fprintf(stderr, "Error: Cannot write a trace to %s\n", trace);
+    }
+    static FsContext ctx;
+    init_context(&ctx, stdout, stderr);
+    process_command_file(&ctx, argv[1]);
+    close_disk(&ctx); // Ensure disk is closed when program exits
+    // Report block cache effectiveness when requested, for sizing CACHE_SIZE against a workload
+    if (getenv("FS_CACHE_STATS")) {
+        const CacheStats *cache_stats = &ctx.cache_stats;
+        fprintf(stderr, "Cache: %lu hits, %lu misses, %lu flushes\n", cache_stats->hits, cache_stats->misses, cache_stats->flushes);
+    }
+    // Report disk I/O volume when requested
+    if (getenv("FS_IO_STATS")) {
+        const IoStats *io_stats = &ctx.io_stats;
+        fprintf(stderr, "I/O: %lu reads (%lu bytes), %lu writes (%lu bytes)\n", io_stats->reads, io_stats->bytes_read, io_stats->writes,
+                io_stats->bytes_written);
+    }
+    if (stats_file && dump_stats(&ctx, stats_file) == -1) {
+        fprintf(stderr, "Error: Cannot write statistics to %s\n", stats_file);
+    }
+    free_context(&ctx);
+    close_trace();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fs-context.h"
+#include "prefill.h"
+
+// Formats a disk image, and optionally populates it with a directory tree and files for benchmarks. The data blocks
+// of a new image are never written (the file is sized with ftruncate and reads back as zeros), so even large images
+// are created in the time it takes to write their metadata.
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mkfs [-g version,block size,blocks,inodes] [-j] [-k] [-c files | -p fill%%] [-z max file blocks]\n"
+                    "            [-f fragmentation%%] [-d depth] [-s seed] <disk name>\n"
+                    "  Without options, makes the same version 1 disk as create_fs.\n"
+                    "  -j gives a version 2 disk a metadata journal, so a crash cannot leave it inconsistent.\n"
+                    "  -k gives a version 2 disk a table of data block checksums, checked on reads and by V.\n"
+                    "  -c creates that many files (-p fills that share of the data blocks instead) in a tree of\n"
+                    "  directories -d levels deep, then -f deletes that share of them at random.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int version = 1;
+    unsigned block_size = V1_BLOCK_SIZE, num_blocks = V1_NUM_BLOCKS, num_inodes = V1_NUM_INODES;
+    PrefillOptions prefill = {0, 0, 8, 0, 0};
+    uint64_t seed = 1;
+    uint32_t features = 0;
+    int option;
+    while ((option = getopt(argc, argv, "g:jkc:p:z:f:d:s:")) != -1) {
+        switch (option) {
+        case 'g':
+            if (sscanf(optarg, "%d,%u,%u,%u", &version, &block_size, &num_blocks, &num_inodes) != 4) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'j': features |= FEATURE_JOURNAL; break;
+        case 'k': features |= FEATURE_CHECKSUMS; break;
+        case 'c': prefill.files = atoi(optarg); break;
+        case 'p': prefill.fill_percent = atoi(optarg); break;
+        case 'z': prefill.max_file_blocks = atoi(optarg); break;
+        case 'f': prefill.fragmentation = atoi(optarg); break;
+        case 'd': prefill.depth = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || prefill.files < 0 || prefill.fill_percent < 0 || prefill.fill_percent > 100 ||
+        prefill.max_file_blocks < 1 || prefill.fragmentation < 0 || prefill.fragmentation > 100 || prefill.depth < 0) {
+        usage();
+        return 1;
+    }
+    char *disk_name = argv[optind];
+    if (format_disk(disk_name, version, block_size, num_blocks, num_inodes, features) != 0) {
+        fprintf(stderr, "Error: Cannot format %s with this geometry\n", disk_name);
+        return 1;
+    }
+    int files = 0;
+    if (prefill.files > 0 || prefill.fill_percent > 0 || prefill.depth > 0) {
+        punch_holes = true; // Blocks freed by the fragmentation pass are zeroed without filling in the sparse image
+        seed_random(seed);
+        static FsContext ctx;
+        init_context(&ctx, stdout, stderr);
+        fs_mount(&ctx, disk_name);
+        if (!ctx.volume->is_mounted) {
+            return 1;
+        }
+        // Creates can fail once the disk is full; that only ends the prefill early, so their errors are not shown
+        FILE *null_stream = fopen("/dev/null", "w");
+        ctx.err = null_stream ? null_stream : stderr;
+        files = prefill_disk(&ctx, &prefill);
+        ctx.err = stderr;
+        if (null_stream) {
+            fclose(null_stream);
+        }
+        free_context(&ctx); // Writes everything back
+        if (files == -1) {
+            fprintf(stderr, "Error: Out of memory populating %s\n", disk_name);
+            return 1;
+        }
+    }
+    printf("Disk %s: version %d, %u blocks of %u bytes, %u inodes, %d files\n", disk_name, version,
+           version == 1 ? V1_NUM_BLOCKS : num_blocks, version == 1 ? V1_BLOCK_SIZE : block_size,
+           version == 1 ? V1_NUM_INODES : num_inodes, files);
+    return 0;
+}
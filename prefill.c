@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prefill.h"
+#include "fs-context.h"
+
+static uint64_t rng_state = 1; // xorshift64* state, so a seed gives the same image on every platform
+
+// Starts the pseudo-random sequence used by random_below over
+void seed_random(uint64_t seed) {
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+// Returns a pseudo-random number in [0, bound)
+uint32_t random_below(uint32_t bound) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ULL) >> 32) % bound;
+}
+
+// Makes a name unique across the whole run: a letter followed by four base-36 digits
+void make_name(char prefix, char name[5]) {
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    static int counter = 0;
+    int value = counter++;
+    name[0] = prefix;
+    for (int i = 4; i >= 1; i--) {
+        name[i] = digits[value % 36];
+        value /= 36;
+    }
+}
+
+// Counts the free data blocks of the mounted disk
+int free_data_blocks(const FsContext *ctx) {
+    int total = 0;
+    for (int i = 0; i < ctx->volume->disk.free_extents.count; i++) {
+        total += ctx->volume->disk.free_extents.runs[i].size;
+    }
+    return total;
+}
+
+// Creates a tree of directories below the current directory, fanout per level
+static void build_tree(FsContext *ctx, int depth, int fanout, int *dirs, int *dir_count) {
+    if (depth == 0) {
+        return;
+    }
+    int parent = ctx->current_inode_index;
+    for (int i = 0; i < fanout; i++) {
+        char name[5];
+        make_name('d', name);
+        fs_create(ctx, name, 0);
+        Inode *dir = find_inode_by_name(ctx, name, parent);
+        if (!dir) {
+            return;
+        }
+        dirs[(*dir_count)++] = dir - ctx->volume->superblock.inode;
+        ctx->current_inode_index = dir - ctx->volume->superblock.inode;
+        build_tree(ctx, depth - 1, fanout, dirs, dir_count);
+        ctx->current_inode_index = parent;
+    }
+}
+
+// Populates the mounted disk: a directory tree, then files in random directories of it, then deletes a share of the
+// files at random to fragment the free space. Stops creating early when the disk runs out of inodes or space, and
+// leaves the current directory at the root. Returns the number of files left, or -1 if out of memory
+int prefill_disk(FsContext *ctx, const PrefillOptions *options) {
+    int *dirs = malloc((ctx->volume->superblock.num_inodes + 1) * sizeof(int));
+    int *files = malloc((ctx->volume->superblock.num_inodes + 1) * sizeof(int));
+    if (!dirs || !files) {
+        free(dirs);
+        free(files);
+        return -1;
+    }
+    int dir_count = 0;
+    dirs[dir_count++] = ctx->volume->superblock.root;
+    ctx->current_inode_index = ctx->volume->superblock.root;
+    build_tree(ctx, options->depth, PREFILL_FANOUT, dirs, &dir_count);
+    int data_blocks = ctx->volume->superblock.num_blocks - ctx->volume->superblock.data_start;
+    int file_count = 0;
+    while (options->files > 0 ? file_count < options->files
+                              : data_blocks - free_data_blocks(ctx) < (long long)data_blocks * options->fill_percent / 100) {
+        char name[5];
+        make_name('f', name);
+        ctx->current_inode_index = dirs[random_below(dir_count)];
+        int before = free_data_blocks(ctx);
+        fs_create(ctx, name, 1 + random_below(options->max_file_blocks));
+        Inode *file = find_inode_by_name(ctx, name, ctx->current_inode_index);
+        if (!file || free_data_blocks(ctx) == before) {
+            break; // Out of inodes or space
+        }
+        files[file_count++] = file - ctx->volume->superblock.inode;
+    }
+    // Fragment: delete the requested share of the files, chosen at random, leaving holes between the rest
+    for (int i = file_count - 1; i > 0; i--) {
+        int j = random_below(i + 1);
+        int swap = files[i];
+        files[i] = files[j];
+        files[j] = swap;
+    }
+    int deleted = (long long)file_count * options->fragmentation / 100;
+    for (int i = 0; i < deleted; i++) {
+        ctx->current_inode_index = ctx->volume->superblock.inode[files[i]].isdir_parent & INODE_FIELD_MASK;
+        char name[5];
+        memcpy(name, ctx->volume->superblock.inode[files[i]].name, 5);
+        fs_delete(ctx, name);
+    }
+    ctx->current_inode_index = ctx->volume->superblock.root;
+    free(files);
+    free(dirs);
+    return file_count - deleted;
+}
@@ -0,0 +1,22 @@
+#ifndef PREFILL_H
+#define PREFILL_H
+#include <stdint.h>
+#include "fs-sim.h"
+
+#define PREFILL_FANOUT 3 // Subdirectories per directory of a prefilled tree
+
+typedef struct {
+    int files;           // Files to create, or 0 to create files until fill_percent of the data blocks are used
+    int fill_percent;    // Share of the data blocks to fill when files is 0
+    int max_file_blocks; // File sizes are drawn uniformly from [1, max_file_blocks]
+    int fragmentation;   // Percentage of the created files deleted again, leaving holes between the rest
+    int depth;           // Levels of directories below the root; files go into random directories of the tree
+} PrefillOptions;
+
+void seed_random(uint64_t seed);
+uint32_t random_below(uint32_t bound);
+void make_name(char prefix, char name[5]);
+int free_data_blocks(const FsContext *ctx);
+int prefill_disk(FsContext *ctx, const PrefillOptions *options);
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs-context.h"
+
+static const char command_letters[] = COMMAND_LETTERS;
+
+bool stats_enabled = false; // Command and I/O latencies are only measured when set (FS_STATS), counters always run
+
+// Returns the current monotonic time in nanoseconds
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Returns the histogram of a command, the "other" histogram for anything that is not a known command letter
+static LatencyHistogram *histogram_of(FsContext *ctx, const char *command) {
+    const char *letter = command[0] != '\0' && command[1] == '\0' ? strchr(command_letters, command[0]) : NULL;
+    return &ctx->stats.command_latency[letter ? letter - command_letters : COMMAND_KINDS];
+}
+
+// Adds the latency of one command to the histogram of its type
+void record_command_latency(FsContext *ctx, const char *command, long long elapsed_ns) {
+    LatencyHistogram *histogram = histogram_of(ctx, command);
+    unsigned long long ns = elapsed_ns > 0 ? elapsed_ns : 0;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && ns >= 1ULL << bucket) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_ns += ns;
+    if (ns > histogram->max_ns) {
+        histogram->max_ns = ns;
+    }
+}
+
+// Adds time spent reading and splitting a command line
+void record_input_time(FsContext *ctx, long long elapsed_ns) {
+    ctx->stats.input_ns += elapsed_ns > 0 ? elapsed_ns : 0;
+}
+
+// Returns an upper bound of the p-th percentile latency: the top of the bucket holding it, capped at the maximum
+static unsigned long long percentile(const LatencyHistogram *histogram, int p) {
+    unsigned long rank = (histogram->count * p + 99) / 100;
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0) {
+            unsigned long long top = i < LATENCY_BUCKETS - 1 ? 1ULL << i : histogram->max_ns;
+            return top < histogram->max_ns ? top : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+// Name of the command a histogram belongs to
+static const char *kind_name(int kind, char letter[2]) {
+    if (kind == COMMAND_KINDS) {
+        return "other";
+    }
+    letter[0] = command_letters[kind];
+    letter[1] = '\0';
+    return letter;
+}
+
+// Estimates the time read-ahead saved: what the reads it served would have cost at the mean time of a direct
+// single-block read, less the time it spent reading windows and serving them; 0 until a direct read was timed
+static long long read_ahead_saved_ns(const ReadAheadStats *stats) {
+    if (stats->direct_reads == 0) {
+        return 0;
+    }
+    return (long long)((stats->windows + stats->hits) * (stats->direct_ns / stats->direct_reads)) - (long long)stats->window_ns;
+}
+
+// Prints the counters, and the command latencies when they are measured (T command)
+void print_stats(FsContext *ctx) {
+    const IoStats *io_stats = &ctx->io_stats;
+    const CacheStats *cache_stats = &ctx->cache_stats;
+    const LookupStats *lookup_stats = &ctx->lookup_stats;
+    if (stats_enabled) {
+        fprintf(ctx->out, "Command  Count     Mean ns      p50 ns      p99 ns      Max ns\n");
+        for (int kind = 0; kind <= COMMAND_KINDS; kind++) {
+            const LatencyHistogram *histogram = &ctx->stats.command_latency[kind];
+            if (histogram->count == 0) {
+                continue;
+            }
+            char letter[2];
+            fprintf(ctx->out, "%-7s %6lu %11llu %11llu %11llu %11llu\n", kind_name(kind, letter), histogram->count,
+                   histogram->total_ns / histogram->count, percentile(histogram, 50), percentile(histogram, 99), histogram->max_ns);
+        }
+        fprintf(ctx->out, "Time: %llu ns reading commands, %llu ns in disk I/O\n", ctx->stats.input_ns, io_stats->io_ns);
+        const ReadAheadStats *read_ahead = &ctx->read_ahead_stats;
+        fprintf(ctx->out, "Read-ahead: %lu windows (%lu blocks ahead), %lu hits, %lu blocks wasted, %lu direct reads, %lld ns saved\n",
+                read_ahead->windows, read_ahead->blocks_ahead, read_ahead->hits, read_ahead->wasted, read_ahead->direct_reads,
+                read_ahead_saved_ns(read_ahead));
+        fprintf(ctx->out, "Zero blocks: %d known, %lu reads and %lu writes skipped\n", count_zero_blocks(ctx), io_stats->zero_reads,
+                io_stats->zero_writes);
+    }
+    fprintf(ctx->out, "I/O: %lu reads (%lu bytes), %lu writes (%lu bytes), %lu holes punched, %lu blocks read, %lu blocks written\n",
+           io_stats->reads, io_stats->bytes_read, io_stats->writes, io_stats->bytes_written, io_stats->punches, io_stats->block_reads,
+           io_stats->block_writes);
+    fprintf(ctx->out, "Cache: %lu hits, %lu misses, %lu flushes\n", cache_stats->hits, cache_stats->misses, cache_stats->flushes);
+    fprintf(ctx->out, "Lookups: %lu by name (%lu probes), %lu free inode searches (%lu probes)\n", lookup_stats->name_lookups,
+           lookup_stats->name_probes, lookup_stats->free_inode_searches, lookup_stats->free_inode_probes);
+}
+
+// Writes every counter and histogram to a file as JSON; returns -1 if the file cannot be written
+int dump_stats(FsContext *ctx, const char *filename) {
+    const IoStats *io_stats = &ctx->io_stats;
+    const CacheStats *cache_stats = &ctx->cache_stats;
+    const LookupStats *lookup_stats = &ctx->lookup_stats;
+    const ReadAheadStats *read_ahead = &ctx->read_ahead_stats;
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        return -1;
+    }
+    fprintf(out, "{\n  \"commands\": {");
+    bool first = true;
+    for (int kind = 0; kind <= COMMAND_KINDS; kind++) {
+        const LatencyHistogram *histogram = &ctx->stats.command_latency[kind];
+        if (histogram->count == 0) {
+            continue;
+        }
+        char letter[2];
+        fprintf(out, "%s\n    \"%s\": {\"count\": %lu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, "
+                "\"buckets\": [", first ? "" : ",", kind_name(kind, letter), histogram->count, histogram->total_ns,
+                percentile(histogram, 50), percentile(histogram, 99), histogram->max_ns);
+        // Trailing empty buckets are left out; bucket i holds latencies under 2^i ns
+        int used = LATENCY_BUCKETS;
+        while (used > 0 && histogram->buckets[used - 1] == 0) {
+            used--;
+        }
+        for (int i = 0; i < used; i++) {
+            fprintf(out, "%s%lu", i ? ", " : "", histogram->buckets[i]);
+        }
+        fprintf(out, "]}");
+        first = false;
+    }
+    fprintf(out, "%s},\n", first ? "" : "\n  ");
+    fprintf(out, "  \"input_ns\": %llu,\n", ctx->stats.input_ns);
+    fprintf(out, "  \"io\": {\"reads\": %lu, \"writes\": %lu, \"bytes_read\": %lu, \"bytes_written\": %lu, \"io_ns\": %llu, "
+            "\"punches\": %lu, \"block_reads\": %lu, \"block_writes\": %lu, \"zero_reads\": %lu, \"zero_writes\": %lu, "
+            "\"zero_blocks\": %d},\n", io_stats->reads, io_stats->writes, io_stats->bytes_read, io_stats->bytes_written, io_stats->io_ns,
+            io_stats->punches, io_stats->block_reads, io_stats->block_writes, io_stats->zero_reads, io_stats->zero_writes,
+            count_zero_blocks(ctx));
+    fprintf(out, "  \"cache\": {\"hits\": %lu, \"misses\": %lu, \"flushes\": %lu},\n", cache_stats->hits, cache_stats->misses,
+            cache_stats->flushes);
+    fprintf(out, "  \"lookups\": {\"name_lookups\": %lu, \"name_probes\": %lu, \"free_inode_searches\": %lu, "
+            "\"free_inode_probes\": %lu},\n", lookup_stats->name_lookups, lookup_stats->name_probes,
+            lookup_stats->free_inode_searches, lookup_stats->free_inode_probes);
+    fprintf(out, "  \"read_ahead\": {\"windows\": %lu, \"blocks_ahead\": %lu, \"hits\": %lu, \"wasted\": %lu, "
+            "\"direct_reads\": %lu, \"direct_ns\": %llu, \"window_ns\": %llu, \"saved_ns\": %lld}\n}\n", read_ahead->windows,
+            read_ahead->blocks_ahead, read_ahead->hits, read_ahead->wasted, read_ahead->direct_reads, read_ahead->direct_ns,
+            read_ahead->window_ns, read_ahead_saved_ns(read_ahead));
+    return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,34 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdbool.h>
+#include "fs-sim.h"
+
+// Power-of-two latency buckets: bucket i counts latencies in [2^(i-1), 2^i) ns, bucket 0 those under 1 ns
+#define LATENCY_BUCKETS 40
+
+typedef struct {
+    unsigned long count;             // commands recorded
+    unsigned long long total_ns;     // sum of their latencies
+    unsigned long long max_ns;       // slowest one
+    unsigned long buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Commands with their own latency histogram; anything else is counted under "other"
+#define COMMAND_LETTERS "MCDRWBLOSYTV"
+#define COMMAND_KINDS (int)(sizeof(COMMAND_LETTERS) - 1)
+
+// Command latencies of one context
+typedef struct {
+    LatencyHistogram command_latency[COMMAND_KINDS + 1]; // One per command letter, the last for unknown commands
+    unsigned long long input_ns;                         // Time spent reading and splitting command lines
+} CommandStats;
+
+long long monotonic_ns(void);
+void record_command_latency(FsContext *ctx, const char *command, long long elapsed_ns);
+void record_input_time(FsContext *ctx, long long elapsed_ns);
+void print_stats(FsContext *ctx);
+int dump_stats(FsContext *ctx, const char *filename);
+
+extern bool stats_enabled;
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+
+#define TRACE_MAGIC "FSTRACE1" // First 8 bytes of a trace file, followed by TraceRecords
+
+// Block I/O calls logged in a trace, one record per call
+enum {
+    TRACE_ATTACH = 'A',    // A disk was attached: block is its block size, count its block count
+    TRACE_READ = 'r',      // read_block
+    TRACE_WRITE = 'w',     // write_block
+    TRACE_READ_RUN = 'R',  // read_blocks
+    TRACE_WRITE_RUN = 'W', // write_blocks
+    TRACE_ZERO = 'Z',      // zero_blocks
+    TRACE_FLUSH = 'F',     // flush_cache (count 0)
+    TRACE_SYNC = 'S'       // sync_disk (count 0)
+};
+
+// One logged call, 24 bytes in host byte order
+typedef struct {
+    uint64_t time_ns; // Since the trace was opened
+    uint32_t block;   // First block of the call
+    uint32_t count;   // Blocks it covers
+    uint32_t line;    // Line of the command that made the call in its command file, 0 outside commands
+    uint8_t op;       // TRACE_READ, TRACE_WRITE, ...
+    char command;     // Letter of that command, 0 outside commands (the final sync, for example)
+    uint16_t reserved;
+} TraceRecord;
+
+#endif